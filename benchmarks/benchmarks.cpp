@@ -0,0 +1,392 @@
+// Measures the performance of the YBoard library on the hardware, and prints the results over
+// serial. Build and upload it with:
+//     pio run -e benchmarks -t upload -t monitor
+//
+// Each benchmark is run several times, and the median, fastest and slowest runs are printed, so
+// results can be compared between library versions and settings. The settings below can be
+// changed with build flags, such as -DBENCHMARK_DISPLAY_ASYNC=0.
+//
+// The SD card benchmarks need a card, and the MP3 benchmark needs a file named benchmark.mp3 on
+// it. Benchmarks for hardware that is missing are skipped.
+
+#include "Arduino.h"
+#include "yboard.h"
+#include "ydsp.h"
+
+#include <AudioTools/AudioCodecs/CodecMP3Helix.h>
+#include <algorithm>
+
+#ifndef BENCHMARK_DISPLAY_ASYNC
+#define BENCHMARK_DISPLAY_ASYNC 1
+#endif
+
+#ifndef BENCHMARK_DISPLAY_CLOCK
+#define BENCHMARK_DISPLAY_CLOCK 400000
+#endif
+
+#ifndef BENCHMARK_SD_SPI_FREQUENCY
+#define BENCHMARK_SD_SPI_FREQUENCY 20000000
+#endif
+
+#ifndef BENCHMARK_AUDIO_IDLE_MS
+#define BENCHMARK_AUDIO_IDLE_MS 100
+#endif
+
+#ifndef BENCHMARK_SLEEP_MS
+#define BENCHMARK_SLEEP_MS 20
+#endif
+
+#ifndef BENCHMARK_ACCELEROMETER_RATE
+#define BENCHMARK_ACCELEROMETER_RATE 400
+#endif
+
+static const int NUM_RUNS = 5;
+static const int DSP_BLOCK_SAMPLES = 256;
+static const int DSP_REPEATS = 1000;
+static const char *MP3_FILE = "/benchmark.mp3";
+
+// Counts the decoded samples without playing them
+class SampleCounter : public AudioOutput {
+  public:
+    uint64_t bytes = 0;
+    AudioInfo info;
+
+    void setAudioInfo(AudioInfo new_info) override { info = new_info; }
+    size_t write(const uint8_t *data, size_t len) override {
+        bytes += len;
+        return len;
+    }
+};
+
+// Runs the benchmark NUM_RUNS times, and prints the median, smallest and largest results
+static void run_benchmark(const char *name, const char *units, float (*benchmark)()) {
+    float results[NUM_RUNS];
+    for (int i = 0; i < NUM_RUNS; i++) {
+        results[i] = benchmark();
+        if (isnan(results[i])) {
+            Serial.printf("%-32s skipped\n", name);
+            return;
+        }
+    }
+
+    std::sort(results, results + NUM_RUNS);
+    Serial.printf("%-32s %10.2f %-8s (min %.2f, max %.2f)\n", name, results[NUM_RUNS / 2], units,
+                  results[0], results[NUM_RUNS - 1]);
+}
+
+////////////////////////////// LEDs ///////////////////////////////////////////
+
+static float led_frame_rate() {
+    const int frames = 200;
+    uint32_t start = micros();
+    for (int frame = 0; frame < frames; frame++) {
+        Yboard.begin_led_frame();
+        for (int i = 1; i <= Yboard.led_count; i++) {
+            Yboard.set_led_color(i, frame, i * 10, 255 - frame);
+        }
+        Yboard.commit_leds();
+    }
+    return frames * 1e6f / (micros() - start);
+}
+
+static float led_unbatched_rate() {
+    const int frames = 50;
+    uint32_t start = micros();
+    for (int frame = 0; frame < frames; frame++) {
+        for (int i = 1; i <= Yboard.led_count; i++) {
+            Yboard.set_led_color(i, frame, i * 10, 255 - frame);
+        }
+    }
+    return frames * 1e6f / (micros() - start);
+}
+
+////////////////////////////// Controls ///////////////////////////////////////
+
+static float knob_latency() {
+    const int calls = 10000;
+    volatile int value = 0;
+    uint32_t start = micros();
+    for (int i = 0; i < calls; i++) {
+        value += Yboard.get_knob();
+    }
+    return (float)(micros() - start) / calls;
+}
+
+static float button_latency() {
+    const int calls = 10000;
+    volatile int pressed = 0;
+    uint32_t start = micros();
+    for (int i = 0; i < calls; i++) {
+        pressed += Yboard.get_button(1);
+    }
+    return (float)(micros() - start) / calls;
+}
+
+////////////////////////////// Accelerometer //////////////////////////////////
+
+static float accelerometer_rate() {
+    if (!Yboard.is_ready(SUBSYSTEM_ACCELEROMETER)) {
+        return NAN;
+    }
+
+    accelerometer_data samples[32];
+    while (Yboard.get_accelerometer_batch(samples, 32) > 0) {
+    }
+
+    uint32_t count = 0;
+    uint32_t start = millis();
+    while (millis() - start < 1000) {
+        count += Yboard.get_accelerometer_batch(samples, 32);
+        delay(5);
+    }
+    return count * 1000.0f / (millis() - start);
+}
+
+////////////////////////////// Display ////////////////////////////////////////
+
+static float display_full_flush() {
+    if (!Yboard.is_ready(SUBSYSTEM_DISPLAY)) {
+        return NAN;
+    }
+
+    // Alternate between two full screens, so every page changes
+    static bool inverted = false;
+    inverted = !inverted;
+    Yboard.display.fillScreen(inverted ? WHITE : BLACK);
+
+    uint32_t start = micros();
+    Yboard.display.display();
+    Yboard.display.wait_for_flush();
+    return (micros() - start) / 1000.0f;
+}
+
+static float display_text_flush() {
+    if (!Yboard.is_ready(SUBSYSTEM_DISPLAY)) {
+        return NAN;
+    }
+
+    // A status line that changes a few characters each time
+    static int counter = 0;
+    Yboard.display.fillRect(0, 0, 64, 8, BLACK);
+    Yboard.display.setCursor(0, 0);
+    Yboard.display.printf("%6d", counter++);
+
+    uint32_t start = micros();
+    Yboard.display.display();
+    Yboard.display.wait_for_flush();
+    return (micros() - start) / 1000.0f;
+}
+
+static float display_call_time() {
+    if (!Yboard.is_ready(SUBSYSTEM_DISPLAY)) {
+        return NAN;
+    }
+
+    // How long loop is held up by display(), which is what matters when the flush is async
+    static bool inverted = false;
+    inverted = !inverted;
+    Yboard.display.fillScreen(inverted ? WHITE : BLACK);
+
+    uint32_t start = micros();
+    Yboard.display.display();
+    uint32_t elapsed = micros() - start;
+    Yboard.display.wait_for_flush();
+    return elapsed / 1000.0f;
+}
+
+////////////////////////////// microSD Card ///////////////////////////////////
+
+static sd_card_speed last_sd_speed;
+
+static float sd_write_speed() {
+    if (!Yboard.is_ready(SUBSYSTEM_SD_CARD) || !Yboard.test_sd_card_speed(last_sd_speed)) {
+        return NAN;
+    }
+    return last_sd_speed.write_kb_per_second / 1024.0f;
+}
+
+static float sd_read_speed() {
+    if (!Yboard.is_ready(SUBSYSTEM_SD_CARD) || !Yboard.test_sd_card_speed(last_sd_speed)) {
+        return NAN;
+    }
+    return last_sd_speed.read_kb_per_second / 1024.0f;
+}
+
+////////////////////////////// Audio //////////////////////////////////////////
+
+// Uses the audio statistics, so the mixing time is measured inside the speaker task
+static float tone_cpu_percent() {
+#if YAUDIO_STATS
+    if (!Yboard.is_ready(SUBSYSTEM_SPEAKER)) {
+        return NAN;
+    }
+
+    // Four-note chords keep every voice busy
+    Yboard.stop_audio();
+    YAudio::reset_stats();
+    uint32_t start = micros();
+    Yboard.play_notes_background("T120 V5 (C1 E1 G1 B1) (D1 F1 A1 C>1)");
+    delay(1500);
+    uint32_t elapsed = micros() - start;
+    YAudio::audio_stats stats = YAudio::get_stats();
+    Yboard.stop_audio();
+
+    return stats.mix_time.total_us * 100.0f / elapsed;
+#else
+    return NAN;
+#endif
+}
+
+// The DSP kernels are timed on the speaker mixer's block size, once with the portable loops and
+// once through the functions the library calls, which use the vector code on the ESP32-S3
+alignas(16) static int16_t dsp_mix[DSP_BLOCK_SAMPLES];
+alignas(16) static int16_t dsp_samples[DSP_BLOCK_SAMPLES];
+
+static float time_dsp_kernel(void (*kernel)()) {
+    for (int i = 0; i < DSP_BLOCK_SAMPLES; i++) {
+        dsp_samples[i] = random(-20000, 20000);
+        dsp_mix[i] = random(-20000, 20000);
+    }
+    uint32_t start = micros();
+    for (int i = 0; i < DSP_REPEATS; i++) {
+        kernel();
+    }
+    return (float)(micros() - start) / DSP_REPEATS;
+}
+
+static float mix_scalar_time() {
+    return time_dsp_kernel([]() {
+        YDSP::mix_scalar(dsp_mix, dsp_samples, DSP_BLOCK_SAMPLES, YDSP::Q15_ONE / 2);
+    });
+}
+
+static float mix_time() {
+    return time_dsp_kernel(
+        []() { YDSP::mix(dsp_mix, dsp_samples, DSP_BLOCK_SAMPLES, YDSP::Q15_ONE / 2); });
+}
+
+// A boost of 3, so the doubling and the add both run
+static float apply_gain_scalar_time() {
+    return time_dsp_kernel(
+        []() { YDSP::apply_gain_scalar(dsp_samples, DSP_BLOCK_SAMPLES, 3 * YDSP::Q8_ONE); });
+}
+
+static float apply_gain_time() {
+    return time_dsp_kernel(
+        []() { YDSP::apply_gain(dsp_samples, DSP_BLOCK_SAMPLES, 3 * YDSP::Q8_ONE); });
+}
+
+// Decoding time divided by the length of the audio. Below 1 is faster than real time.
+static float mp3_real_time_factor() {
+    if (!Yboard.is_ready(SUBSYSTEM_SD_CARD)) {
+        return NAN;
+    }
+
+    // Through the board's file system, so it is measured with SD_MMC too
+    File file = Yboard.get_file_system().open(MP3_FILE);
+    if (!file) {
+        return NAN;
+    }
+    SampleCounter counter;
+    MP3DecoderHelix mp3;
+    EncodedAudioStream decoder(&counter, &mp3);
+    mp3.addNotifyAudioChange(counter);
+    decoder.begin();
+
+    uint8_t chunk[512];
+    size_t len;
+    uint32_t start = micros();
+    while ((len = file.read(chunk, sizeof(chunk))) > 0) {
+        decoder.write(chunk, len);
+    }
+    uint32_t elapsed = micros() - start;
+    decoder.end();
+    file.close();
+
+    size_t frame_bytes = counter.info.channels * counter.info.bits_per_sample / 8;
+    if (frame_bytes == 0 || counter.info.sample_rate == 0) {
+        return NAN;
+    }
+    float audio_us = (float)counter.bytes / frame_bytes / counter.info.sample_rate * 1e6f;
+    return elapsed / audio_us;
+}
+
+////////////////////////////// Power //////////////////////////////////////////
+
+// Sleeps until a timer wakes the board, and then plays a note with the speaker powered down, so
+// this is the whole time from waking up to the first samples being written to the speaker
+static float wake_to_first_sound() {
+    if (!Yboard.is_ready(SUBSYSTEM_SPEAKER)) {
+        return NAN;
+    }
+
+    // The speaker powers down once the note from the last run is done
+    uint32_t start = millis();
+    while (!Yboard.light_sleep(BENCHMARK_SLEEP_MS)) {
+        if (millis() - start > 5000) {
+            return NAN;
+        }
+        delay(1);
+    }
+
+    uint32_t woke_at = micros();
+    uint32_t restarts = YAudio::get_power_stats().speaker_restarts;
+    Yboard.play_notes_background("C16");
+    while (YAudio::get_power_stats().speaker_restarts == restarts) {
+        if (micros() - woke_at > 1000000) {
+            return NAN;
+        }
+    }
+    return (micros() - woke_at) / 1000.0f;
+}
+
+void setup() {
+    Serial.begin(115200);
+
+    yboard_config config;
+    config.accelerometer.rate = BENCHMARK_ACCELEROMETER_RATE;
+    config.display.async = BENCHMARK_DISPLAY_ASYNC;
+    config.display.i2c_clock = BENCHMARK_DISPLAY_CLOCK;
+    config.sd_card.spi_frequency = BENCHMARK_SD_SPI_FREQUENCY;
+    Yboard.setup(config);
+
+    Serial.printf("\nYBoard benchmarks, %d runs each, CPU at %u MHz\n", NUM_RUNS,
+                  ESP.getCpuFreqMHz());
+    Serial.printf("Display async %d at %d Hz, SD SPI at %d Hz, accelerometer at %d Hz\n\n",
+                  BENCHMARK_DISPLAY_ASYNC, BENCHMARK_DISPLAY_CLOCK, BENCHMARK_SD_SPI_FREQUENCY,
+                  BENCHMARK_ACCELEROMETER_RATE);
+
+    // The blocking LED output is measured before async output is turned on, since it can't be
+    // turned back off
+    run_benchmark("LED frames (blocking)", "frames/s", led_frame_rate);
+    run_benchmark("LED updates without frames", "frames/s", led_unbatched_rate);
+    if (Yboard.enable_async_leds()) {
+        run_benchmark("LED frames (async)", "frames/s", led_frame_rate);
+    }
+    Yboard.set_all_leds_color(0, 0, 0);
+
+    run_benchmark("get_knob", "us", knob_latency);
+    run_benchmark("get_button", "us", button_latency);
+    run_benchmark("Accelerometer", "samples/s", accelerometer_rate);
+    run_benchmark("Display full screen", "ms", display_full_flush);
+    run_benchmark("Display status line", "ms", display_text_flush);
+    run_benchmark("Display call (loop blocked)", "ms", display_call_time);
+    run_benchmark("SD write", "MB/s", sd_write_speed);
+    run_benchmark("SD read", "MB/s", sd_read_speed);
+    run_benchmark("Tone synth CPU (4 voices)", "%", tone_cpu_percent);
+    run_benchmark("Mix block (scalar)", "us", mix_scalar_time);
+    run_benchmark("Mix block", "us", mix_time);
+    run_benchmark("Gain block (scalar)", "us", apply_gain_scalar_time);
+    run_benchmark("Gain block", "us", apply_gain_time);
+    run_benchmark("MP3 decode real-time factor", "x", mp3_real_time_factor);
+
+    // Low power mode can't be turned back off, so this goes last
+    low_power_config power;
+    power.audio_idle_ms = BENCHMARK_AUDIO_IDLE_MS;
+    Yboard.enable_low_power(power);
+    run_benchmark("Wake to first sound", "ms", wake_to_first_sound);
+
+    Serial.println("\nDone");
+}
+
+void loop() { delay(1000); }
@@ -0,0 +1,118 @@
+// Measures the note compiler on the host, without the board. Build and run it with:
+//     pio run -e native && .pio/build/native/program
+//
+// Like the on-device benchmarks, each benchmark is run several times, and the median, fastest and
+// slowest runs are printed. Heap allocations are counted by replacing operator new, so any
+// allocation added to the compiler shows up here.
+
+#include "ynotes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+static const int NUM_RUNS = 5;
+static const uint32_t SAMPLE_RATE = 44100;
+static const size_t SONG_LENGTH = 4000;
+
+// A queue this long holds every note of the test songs
+static const uint32_t QUEUE_SIZE = 4096;
+
+static size_t allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// Repeats the whole pattern as many times as fits in length characters
+static std::string make_song(const std::string &pattern, size_t length) {
+    std::string song;
+    while (song.size() + pattern.size() <= length) {
+        song += pattern;
+    }
+    return song;
+}
+
+struct benchmark_result {
+    double chars_per_second;
+    double notes_per_second;
+    double allocations_per_note;
+};
+
+// Compiles the song over and over for about 100 ms, like add_notes does on the device
+static benchmark_result compile_song(const std::string &song) {
+    static YNotes::note notes[QUEUE_SIZE];
+    size_t start_allocations = allocations;
+    uint64_t total_notes = 0;
+    int iterations = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::steady_clock::duration::zero();
+    while (elapsed < std::chrono::milliseconds(100)) {
+        YNotes::note_state state;
+        YNotes::note_queue queue = {notes, QUEUE_SIZE, 0, 0};
+        if (YNotes::compile(song.c_str(), state, SAMPLE_RATE, queue) != YNotes::COMPILE_OK) {
+            printf("Song did not compile\n");
+            exit(1);
+        }
+        total_notes += queue.tail;
+        iterations++;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    benchmark_result result;
+    result.chars_per_second = song.size() * iterations / seconds;
+    result.notes_per_second = total_notes / seconds;
+    result.allocations_per_note = (double)(allocations - start_allocations) / total_notes;
+    return result;
+}
+
+static void print_stat(const char *name, const char *units, std::vector<double> results) {
+    std::sort(results.begin(), results.end());
+    printf("  %-22s %12.2f %-8s (min %.2f, max %.2f)\n", name, results[NUM_RUNS / 2], units,
+           results[0], results[NUM_RUNS - 1]);
+}
+
+// Runs the benchmark NUM_RUNS times, and prints the median, smallest and largest results
+static void run_benchmark(const char *name, const char *pattern) {
+    std::string song = make_song(pattern, SONG_LENGTH);
+    std::vector<double> chars, notes, allocs;
+    for (int i = 0; i < NUM_RUNS; i++) {
+        benchmark_result result = compile_song(song);
+        chars.push_back(result.chars_per_second / 1e6);
+        notes.push_back(result.notes_per_second / 1e6);
+        allocs.push_back(result.allocations_per_note);
+    }
+
+    printf("%s (%zu chars)\n", name, song.size());
+    print_stat("Parse throughput", "Mchars/s", chars);
+    print_stat("Notes compiled", "Mnotes/s", notes);
+    print_stat("Allocations", "per note", allocs);
+}
+
+// The unit tests are built in the same environment, and bring their own main()
+#ifndef PIO_UNIT_TESTING
+int main() {
+    printf("Note compiler benchmarks, %d runs each\n\n", NUM_RUNS);
+
+    run_benchmark("Plain notes", "C D E F G A B C ");
+    run_benchmark("Notes with modifiers", "O5 C4 D#8 E-8. F>16 G<2 A#4. R8 B16 ");
+    run_benchmark("Chords", "V7 W2 (C E G) (D2 F2 A2) (E4. G4. B4. C>4.) (F A C>) ");
+    run_benchmark("Settings changes", "T100 O4 C T160 O6 D V3 E W3 F ! G ");
+
+    return 0;
+}
+#endif
@@ -8,6 +8,9 @@ void setup() {
 }
 
 void loop() {
+    // Update all of the LEDs at once at the end of the loop
+    Yboard.begin_led_frame();
+
     if (Yboard.get_switch(1)) {
         Yboard.set_led_color(1, 255, 0, 0);
     } else {
@@ -41,4 +44,6 @@ void loop() {
         Yboard.set_led_color(7, map(accel_data.y, -1000, 1000, 0, 255), 0, 0);
         Yboard.set_led_color(8, map(accel_data.z, -1000, 1000, 0, 255), 0, 0);
     }
+
+    Yboard.commit_leds();
 }
@@ -0,0 +1,70 @@
+#ifndef YACCEL_H
+#define YACCEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct accelerometer_data {
+    float x;
+    float y;
+    float z;
+};
+
+namespace YAccel {
+
+// The rate is in samples per second, and is rounded up to one the accelerometer supports (1, 10,
+// 25, 50, 100, 200, 400, or 1344). The accelerometer interrupts once the watermark number of
+// samples (1-31) are in its FIFO. Without an interrupt pin, the FIFO is checked on a timer.
+//
+// The motion detectors run on the accelerometer itself. Thresholds are in mg, up to 2000. Taps
+// are detected most reliably at rates of 200 or more.
+struct accelerometer_config {
+    int rate = 100;
+    uint8_t watermark = 16;
+    int int_pin = -1;
+
+    bool detect_taps = false;
+    bool detect_double_taps = false;
+    int tap_threshold = 1000;
+    bool detect_free_fall = false;
+    int free_fall_threshold = 350;
+    bool detect_orientation = false;
+};
+
+enum motion_event_type { MOTION_TAP, MOTION_DOUBLE_TAP, MOTION_FREE_FALL, MOTION_ORIENTATION };
+
+// For taps, the axis and direction of the tap. For orientation changes, the axis that is now
+// pointing up.
+enum motion_direction {
+    DIRECTION_X_POSITIVE,
+    DIRECTION_X_NEGATIVE,
+    DIRECTION_Y_POSITIVE,
+    DIRECTION_Y_NEGATIVE,
+    DIRECTION_Z_POSITIVE,
+    DIRECTION_Z_NEGATIVE,
+    DIRECTION_NONE
+};
+
+struct motion_event {
+    motion_event_type type;
+    motion_direction direction;
+    uint32_t timestamp; // millis() when the event was read
+};
+
+typedef void (*motion_event_callback)(const motion_event &event, void *arg);
+
+bool setup(uint8_t address, const accelerometer_config &config);
+bool available();
+accelerometer_data get_latest();
+size_t get_batch(accelerometer_data *samples, size_t max_samples);
+uint32_t get_overruns();
+bool poll_motion_event(motion_event &event);
+void set_motion_event_callback(motion_event_callback callback, void *arg);
+
+// Light sleep stops the interrupt pin's interrupt, so the pin wakes the board instead. This needs
+// int_pin. The interrupt is for both motion events and the FIFO filling to the watermark.
+bool enable_wakeup();
+void end_wakeup();
+}; // namespace YAccel
+
+#endif /* YACCEL_H */
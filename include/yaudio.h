@@ -2,24 +2,127 @@
 #define YAUDIO_H
 
 #include <AudioTools.h>
+#include <FS.h>
 #include <stdint.h>
 #include <string>
 
+// Build with -DYAUDIO_STATS=1 to collect statistics about the audio tasks for get_stats. Without
+// it, none of the instrumentation is compiled in.
+#ifndef YAUDIO_STATS
+#define YAUDIO_STATS 0
+#endif
+
 namespace YAudio {
 
-bool setup_speaker(int ws_pin, int bck_pin, int data_pin, int i2s_port);
-bool setup_mic(int ws_pin, int data_pin, int i2s_port);
+// Sources that are mixed together on the speaker. Each has its own volume.
+enum audio_channel { CHANNEL_NOTES, CHANNEL_SOUND_FILE, CHANNEL_SOUND_EFFECTS, NUM_AUDIO_CHANNELS };
+
+// Formats recordings can be saved in. IMA-ADPCM files are a quarter of the size of 16-bit PCM.
+enum recording_codec { CODEC_PCM, CODEC_IMA_ADPCM };
+
+// Called from the mic capture task with each frame of 16-bit mono samples read from the mic
+typedef void (*mic_frame_callback)(const int16_t *samples, size_t num_samples, void *arg);
+
+// Where and how each of the audio tasks runs. A core of tskNO_AFFINITY lets the task run on
+// either core.
+struct task_config {
+    BaseType_t core;
+    UBaseType_t priority;
+    uint32_t stack_size;
+};
+
+// By default, audio runs on core 0, away from the Arduino loop on core 1, at priorities above
+// loop. Producing samples comes first, then reading ahead, then writing recordings, which has
+// the most buffering.
+struct audio_config {
+    task_config speaker_task = {0, 5, 4096};
+    task_config sd_reader_task = {0, 4, 4096};
+    task_config mic_capture_task = {0, 5, 4096};
+    task_config record_writer_task = {0, 3, 4096};
+};
+
+struct stream_buffer_stats {
+    size_t buffer_size;
+    size_t fill_level;
+    size_t min_fill_level;
+    uint32_t underruns;
+};
+
+// Counts of the speaker being restarted by power save. The restart time is from the speaker task
+// waking up with the speaker stopped to the first block of samples being written to it.
+struct power_stats {
+    uint32_t speaker_restarts;
+    uint32_t last_restart_us;
+    uint32_t max_restart_us;
+};
+
+#if YAUDIO_STATS
+// Times are counted in buckets by powers of two. Bucket 0 counts times under 1 us, bucket i
+// counts times from 2^(i-1) us up to 2^i us, and the last bucket counts everything longer.
+static const int STATS_HISTOGRAM_BUCKETS = 16;
+
+struct timing_stats {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t total_us;
+    uint32_t histogram[STATS_HISTOGRAM_BUCKETS];
+};
+
+// The underrun and overrun counts for the I2S devices are estimated from the time between reads
+// or writes, against how long the DMA buffers last, so they can miss some. The latencies are from
+// when a sound is started to when its first samples are mixed, and don't include the time for
+// them to get through the DMA buffers.
+struct audio_stats {
+    uint32_t speaker_underruns;
+    uint32_t mic_overruns;
+    uint32_t stream_underruns;
+    uint32_t recording_overruns;
+    timing_stats mix_time;       // Mixing each block for the speaker
+    timing_stats mic_frame_time; // Filtering, recording, and the callback for each mic frame
+    timing_stats compile_time;   // Compiling the notes in each call to add_notes
+    timing_stats start_latency[NUM_AUDIO_CHANNELS];
+};
+#endif
+
+bool setup_speaker(int ws_pin, int bck_pin, int data_pin, int i2s_port,
+                   const audio_config &tasks = audio_config());
+bool setup_mic(int ws_pin, int data_pin, int i2s_port, const audio_config &tasks = audio_config());
 I2SStream &get_speaker_stream();
 I2SStream &get_mic_stream();
+void set_mic_callback(mic_frame_callback callback, void *arg);
 void set_wave_volume(uint8_t volume);
+void set_channel_volume(audio_channel channel, uint8_t volume);
 bool add_notes(const std::string &new_notes);
 void stop_speaker();
 bool is_playing();
+bool is_channel_playing(audio_channel channel);
+void wait_for_channel(audio_channel channel);
+void wait_for_playback();
+void set_file_system(fs::FS &file_system, const char *mount_point);
+bool build_file_index(const char *directory = "/");
+bool play_sound_file(const char *filename);
 bool play_sound_file(const std::string &filename);
+int cache_sound_file(const std::string &filename);
+bool play_cached_sound(int id);
+bool set_stream_buffer_size(size_t size);
+stream_buffer_stats get_stream_buffer_stats();
 bool start_recording(const std::string &filename);
+bool start_recording(const std::string &filename, const AudioInfo &info, recording_codec codec);
 void stop_recording();
 bool is_recording();
+uint32_t get_recording_overruns();
 void set_recording_gain(uint8_t new_gain);
+
+// With power save on, the speaker and mic I2S devices are stopped once they have been idle for
+// idle_ms, and started again when they are next needed. An idle_ms of 0 turns it off. The streams
+// from get_speaker_stream and get_mic_stream can't be used directly while it is on.
+void set_power_save(uint32_t idle_ms);
+bool is_powered_down();
+power_stats get_power_stats();
+#if YAUDIO_STATS
+audio_stats get_stats();
+void reset_stats();
+#endif
 }; // namespace YAudio
 
 #endif /* YAUDIO_H */
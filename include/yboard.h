@@ -2,19 +2,79 @@
 #define YBOARDV3_H
 
 #include <Adafruit_NeoPixel.h>
-#include <Adafruit_SSD1306.h>
 #include <AudioTools.h>
 #include <FS.h>
 #include <SD.h>
-#include <SparkFun_LIS2DH12.h>
+#include <SD_MMC.h>
 #include <stdint.h>
 
+#include "yaccel.h"
 #include "yaudio.h"
+#include "ydisplay.h"
+#include "yi2c.h"
+#include "yinputs.h"
+#include "yleds.h"
+
+// The microSD card is normally used over SPI. The SPI clock can be raised up to 40 MHz if the card
+// and wiring allow it. If the card doesn't start at spi_frequency, it is tried again at 4 MHz.
+//
+// With use_sd_mmc, the card is used with the SD_MMC driver instead. The SPI wiring is used as a
+// 1-bit SD bus: SCK is CLK, MOSI is CMD, and MISO is D0. This needs pull-ups on those lines. On
+// boards with D1 and D2 wired, setting their pins switches to the 4-bit bus, with CS used as D3.
+struct sd_card_config {
+    uint32_t spi_frequency = 20000000;
+    uint8_t max_open_files = 5;
+    bool use_sd_mmc = false;
+    int sd_mmc_frequency_khz = 20000;
+    int sd_mmc_d1_pin = -1;
+    int sd_mmc_d2_pin = -1;
+};
+
+// Results of YBoardV3::test_sd_card_speed
+struct sd_card_speed {
+    uint32_t write_kb_per_second;
+    uint32_t read_kb_per_second;
+};
+
+// Settings for YBoardV3::enable_low_power. The speaker and microphone are powered down once they
+// have been idle for audio_idle_ms, which must be more than 0. The wake settings are what can wake
+// the board from YBoardV3::light_sleep. Waking on the accelerometer needs its interrupt pin set in
+// accelerometer_config, and it also wakes the board each time the accelerometer's FIFO fills to
+// the watermark.
+struct low_power_config {
+    uint32_t audio_idle_ms = 1000;
+    bool wake_on_buttons = true;
+    bool wake_on_switches = true;
+    bool wake_on_accelerometer = true;
+};
+
+// Settings for YBoardV3::setup. The defaults work for most programs.
+//
+// With async_setup, setup only sets up the LEDs, buttons, switches and knob before returning. The
+// rest is set up in the background, with the microSD card, the audio devices and the I2C devices
+// each set up at the same time by a separate task. Until a part reports being set up, it must not
+// be used: the display must not be drawn on, and the audio functions fail and return false until
+// SUBSYSTEM_SPEAKER (or SUBSYSTEM_MICROPHONE, for recording) is ready.
+//
+// LED animations are drawn led_frame_rate times a second.
+struct yboard_config {
+    YAudio::audio_config audio;
+    YAccel::accelerometer_config accelerometer;
+    display_config display;
+    sd_card_config sd_card;
+    bool async_setup = false;
+    int led_frame_rate = 50;
+};
 
-struct accelerometer_data {
-    float x;
-    float y;
-    float z;
+// Parts of the YBoard that setup brings up. They can be combined with |, as in
+// SUBSYSTEM_DISPLAY | SUBSYSTEM_ACCELEROMETER.
+enum yboard_subsystem {
+    SUBSYSTEM_SD_CARD = 0x01,
+    SUBSYSTEM_SPEAKER = 0x02,
+    SUBSYSTEM_MICROPHONE = 0x04,
+    SUBSYSTEM_ACCELEROMETER = 0x08,
+    SUBSYSTEM_DISPLAY = 0x10,
+    SUBSYSTEM_ALL = 0x1F
 };
 
 class YBoardV3 {
@@ -28,6 +88,39 @@ class YBoardV3 {
      */
     void setup();
 
+    /*
+     *  This is similar to the function above, except that it takes settings for how the YBoard
+     * runs in the background. For example, the audio tasks can be moved to another core, or given
+     * larger stacks:
+     *     yboard_config config;
+     *     config.audio.speaker_task.stack_size = 8192;
+     *     Yboard.setup(config);
+     */
+    void setup(const yboard_config &config);
+
+    /*
+     *  This function waits for parts of the YBoard to finish setting up, when setup was called
+     * with config.async_setup turned on. The subsystems are which parts to wait for, and the
+     * timeout is the longest to wait in milliseconds. The return type is a boolean value (true or
+     * false). True corresponds to all of them having been set up successfully, and false
+     * corresponds to one of them failing or not being finished in time. The display must not be
+     * drawn on until it has been set up. For example:
+     *     yboard_config config;
+     *     config.async_setup = true;
+     *     Yboard.setup(config);
+     *     Yboard.wait_for_setup(SUBSYSTEM_DISPLAY);
+     *     Yboard.display.println("Loading...");
+     *     Yboard.display.display();
+     */
+    bool wait_for_setup(int subsystems, uint32_t timeout_ms = UINT32_MAX);
+
+    /*
+     *  This function returns whether parts of the YBoard have been set up successfully, without
+     * waiting. The return type is a boolean value (true or false). True corresponds to all of the
+     * subsystems being ready, and false corresponds to one still being set up or having failed.
+     */
+    bool is_ready(int subsystems);
+
     ////////////////////////////// LEDs ///////////////////////////////////////////
 
     /*
@@ -56,6 +149,83 @@ class YBoardV3 {
      */
     void set_all_leds_color(uint8_t red, uint8_t green, uint8_t blue);
 
+    /*
+     *  This function starts a batch of LED updates. Until commit_leds is called, the
+     * set_led_color, set_all_leds_color, and set_led_brightness functions only change the
+     * colors stored in memory and do not update the LEDs. Updating the LEDs takes time, so
+     * when changing several LEDs at once it is much faster to change them all and then
+     * update the LEDs one time.
+     */
+    void begin_led_frame();
+
+    /*
+     *  This function ends a batch of LED updates that was started with begin_led_frame and
+     * updates the LEDs with the new colors. If none of the colors changed since the LEDs
+     * were last updated, the LEDs are not updated at all.
+     */
+    void commit_leds();
+
+    /*
+     *  This function makes the LEDs update in the background. Normally the program waits while
+     * the new colors are sent to the LEDs. After this function is called, the colors are handed
+     * off to the hardware and the program keeps running while the LEDs are updated. The return
+     * type is a boolean value (true or false). True corresponds to background updates being
+     * enabled, and false corresponds to an error, in which case the LEDs keep updating normally.
+     * Once enabled, background updates stay enabled.
+     */
+    bool enable_async_leds();
+
+    /*
+     *  This function starts an LED animation, which plays in the background until it is stopped,
+     * so loop doesn't need to keep changing the LEDs or call delay. The animation is a list of
+     * keyframes, which are colors at times in milliseconds, and the LEDs fade smoothly from one
+     * keyframe to the next. Up to 4 animations can play at once, on different LEDs. Colors set
+     * with set_led_color show on the LEDs that no animation covers. The LEDs are numbered from 0
+     * in YLeds::animation, so first_led = 0 is LED 1. The return type is an integer, which is
+     * the animation's id for stop_led_animation, or -1 if it couldn't be started. For example,
+     * to fade LEDs 1 to 5 from blue to red and back every 2 seconds:
+     *     YLeds::animation animation;
+     *     animation.keyframes[0] = {0, 0, 0, 255};
+     *     animation.keyframes[1] = {1000, 255, 0, 0};
+     *     animation.num_keyframes = 2;
+     *     animation.period_ms = 2000;
+     *     animation.num_leds = 5;
+     *     int id = Yboard.start_led_animation(animation);
+     */
+    int start_led_animation(const YLeds::animation &animation);
+
+    /*
+     *  This function starts all of the LEDs slowly fading on and off in the given color, once
+     * every period_ms milliseconds. The return type is an integer, which is the animation's id
+     * for stop_led_animation, or -1 if it couldn't be started.
+     */
+    int start_led_breathing(uint8_t red, uint8_t green, uint8_t blue, uint32_t period_ms = 2000);
+
+    /*
+     *  This function starts a light in the given color chasing around the LEDs, going all the way
+     * around once every period_ms milliseconds. The return type is an integer, which is the
+     * animation's id for stop_led_animation, or -1 if it couldn't be started.
+     */
+    int start_led_chase(uint8_t red, uint8_t green, uint8_t blue, uint32_t period_ms = 1000);
+
+    /*
+     *  This function starts a rainbow moving around the LEDs, going all the way around once every
+     * period_ms milliseconds. The return type is an integer, which is the animation's id for
+     * stop_led_animation, or -1 if it couldn't be started.
+     */
+    int start_led_rainbow(uint32_t period_ms = 2000);
+
+    /*
+     *  This function stops an LED animation, using the id from when it was started. The LEDs it
+     * covered go back to the colors set with set_led_color.
+     */
+    void stop_led_animation(int id);
+
+    /*
+     *  This function stops all of the LED animations.
+     */
+    void stop_all_led_animations();
+
     ////////////////////////////// Switches/Buttons ///////////////////////////////
     /*
      *  This function returns the state of a switch.
@@ -77,6 +247,32 @@ class YBoardV3 {
      */
     bool get_button(uint8_t button_idx);
 
+    /*
+     *  This function gets the next change to the buttons or switches, so that loop doesn't have to
+     * keep checking get_button and get_switch to catch every press. The return type is a boolean
+     * value (true or false). True corresponds to an event being returned in event, and false
+     * corresponds to nothing having happened since the last call. Each event says which input
+     * changed (for example, YInputs::INPUT_BUTTON_1), what happened (YInputs::INPUT_PRESSED,
+     * INPUT_RELEASED, or INPUT_LONG_PRESS when a button is held for a second), and the time in
+     * milliseconds when it happened. Turning a switch on counts as a press, and turning it off
+     * counts as a release. For example:
+     *     YInputs::input_event event;
+     *     while (Yboard.poll_input_event(event)) {
+     *         if (event.input == YInputs::INPUT_BUTTON_1 && event.type == YInputs::INPUT_PRESSED) {
+     *             Serial.println("Button 1 pressed");
+     *         }
+     *     }
+     */
+    bool poll_input_event(YInputs::input_event &event);
+
+    /*
+     *  This function sets a function to be called with each change to the buttons or switches,
+     * instead of getting them from poll_input_event. The function runs in the background, so it
+     * should finish quickly. The arg value is passed along to the function. Pass NULL as the
+     * callback to go back to using poll_input_event.
+     */
+    void set_input_event_callback(YInputs::input_event_callback callback, void *arg);
+
     /*
      *  This function returns the value of the knob.
      *  The return type is an integer between 0 and 100, representing the position
@@ -86,22 +282,58 @@ class YBoardV3 {
      */
     int get_knob();
 
+    /*
+     *  This function sets a function to be called when the knob is turned. The function is given
+     * the new value of the knob (the same as get_knob), and is only called once the knob has moved
+     * by at least the threshold since the last call. For example, a threshold of 5 calls the
+     * function about 20 times from one end of the knob to the other. The function runs in the
+     * background, so it should finish quickly. The arg value is passed along to the function. Pass
+     * NULL as the callback to stop.
+     */
+    void set_knob_callback(YInputs::knob_callback callback, int threshold, void *arg);
+
     ////////////////////////////// Speaker/Tones //////////////////////////////////
     /*
      *  This function plays a sound on the speaker. The filename is a string
      * representing the name of the sound file to play. The return type is a boolean
      * value (true or false). True corresponds to the sound being played
      * successfully, and false corresponds to an error playing the sound. The sound
-     * file must be stored on the microSD card.
+     * file must be stored on the microSD card. Notes and preloaded sounds keep playing
+     * on top of the sound file.
      */
     bool play_sound_file(const std::string &filename);
+    bool play_sound_file(const char *filename);
 
     /* This is similar to the function above, except that it will start the song playing
      * in the background and return immediately. The song will continue to play in the
      * background until it is stopped with the stop_audio function, another song is
-     * played, play_notes is called, or the song finishes.
+     * played, or the song finishes. The sound files on the microSD card are listed when the
+     * YBoard is set up, so these start without searching the card for the file. Files added
+     * later, such as recordings, still play, but take a little longer to start.
      */
     bool play_sound_file_background(const std::string &filename);
+    bool play_sound_file_background(const char *filename);
+
+    /*
+     * This function loads a sound file from the microSD card into memory ahead of time, so it
+     * can be played later with play_cached_sound without any delay from reading the card. This
+     * is useful for short sounds that need to play right away, such as sound effects in a game.
+     * The return value is an ID for the sound to pass to play_cached_sound, or -1 if there was an
+     * error loading the sound. If memory runs out while loading more sounds, the sounds that were
+     * played least recently are removed from memory, and their IDs stop working.
+     */
+    int preload_sound_file(const std::string &filename);
+
+    /*
+     * This function plays a sound that was loaded into memory with preload_sound_file. The sound
+     * starts playing in the background and the function returns immediately, just like
+     * play_sound_file_background. It plays on top of any sound file or notes that are already
+     * playing, and up to 2 preloaded sounds can play at once (starting a third stops the one that
+     * started first). The return type is a boolean value (true or false). True corresponds to the
+     * sound being played successfully, and false corresponds to the sound no longer being in
+     * memory.
+     */
+    bool play_cached_sound(int sound_id);
 
     /*
      * This function sets the speaker volume when playing a sound file. The volume
@@ -111,6 +343,30 @@ class YBoardV3 {
      */
     void set_sound_file_volume(uint8_t volume);
 
+    /*
+     * This function sets the volume of the sounds played with play_cached_sound. The volume is
+     * an integer between 0 and 10. A volume of 0 is off, and a volume of 10 is full volume.
+     */
+    void set_sound_effect_volume(uint8_t volume);
+
+    /*
+     * Sound files are read from the microSD card ahead of time into a buffer, so that short
+     * delays while reading the card don't interrupt the sound. This function sets the size of that
+     * buffer in bytes. The default is 64 KB on boards with PSRAM and 16 KB otherwise. A larger
+     * buffer handles slower microSD cards. This function can only be called while no audio is
+     * playing. The return type is a boolean value (true or false). True corresponds to the buffer
+     * being resized successfully, and false corresponds to an error.
+     */
+    bool set_sound_file_buffer_size(size_t size);
+
+    /*
+     * This function returns information about the sound file buffer: its size, how full it is
+     * right now, the lowest it has been during the current sound file, and the number of times it
+     * ran empty while playing (each of which is an audible dropout). These can be used to pick a
+     * buffer size for a particular microSD card.
+     */
+    YAudio::stream_buffer_stats get_sound_file_buffer_stats();
+
     /* Plays the specified sequence of notes. The function will return once the notes
      * have finished playing.
      *
@@ -126,7 +382,12 @@ class YBoardV3 {
      * O followed by a #    Changes the octave. Valid range is 4-7. Default is 5.
      * T followed by a #    Changes the tempo. Valid range is 40-240. Default is 120.
      * V followed by a #    Changes the volume.  Valid range is 1-10. Default is 5.
-     * !                    Resets octave, tempo, and volume to default values.
+     * W followed by a #    Changes the waveform. 1 is sine, 2 is square, 3 is triangle, and 4 is
+     *                      sawtooth. Default is 1.
+     * ( and )              Notes between parentheses are played together as a chord, which lasts
+     *                      as long as its longest note. Up to 4 notes can be played at once
+     *                      (eg: "(C2 E2 G2)" plays a C major chord as a half note).
+     * !                    Resets octave, tempo, volume, and waveform to default values.
      * spaces               Spaces can be placed between notes or commands for readability,
      *                      but not within a note or command (eg: "C4# D4" is valid, "C 4 # D 4" is
      *                      not. "T120 A B C" is valid, "T 120 A B C" is not).
@@ -135,15 +396,17 @@ class YBoardV3 {
 
     /* This is similar to the function above, except that it will start playing the notes
      * in the background and return immediately. The notes will continue to play in the
-     * background until they are stopped with the stop_audio function, a WAVE file is played,
-     * or the notes finish. If you call this function again before the notes finish, the
-     * the new notes will be appended to the end of the current notes.  This allows you to
+     * background until they are stopped with the stop_audio function or the notes finish. Sound
+     * files and preloaded sounds can be played at the same time as the notes. If you call this
+     * function again before the notes finish, the new notes will be appended to the end of the
+     * current notes.  This allows you to
      * call this function multiple times to build up multiple sequences of notes to play.
      */
     bool play_notes_background(const std::string &new_notes);
 
     /*
-     * This function stops the audio from playing (either a song or a sequence of notes)
+     * This function stops the audio from playing (songs, sequences of notes, and preloaded
+     * sounds)
      */
     void stop_audio();
 
@@ -171,6 +434,19 @@ class YBoardV3 {
      */
     bool start_recording(const std::string &filename);
 
+    /*
+     * This is similar to the function above, except that it also picks the format of the
+     * recording. The info holds the sample rate (for example 16000 or 44100), the number of
+     * channels (which must be 1), and the number of bits per sample (8 or 16). The codec is
+     * either YAudio::CODEC_PCM, which saves the samples as they are, or YAudio::CODEC_IMA_ADPCM,
+     * which compresses them to a quarter of the size of 16-bit samples. Lower sample rates and
+     * compression make smaller files, which is useful for long recordings. For example:
+     *     start_recording("log.wav", AudioInfo(16000, 1, 16), YAudio::CODEC_IMA_ADPCM);
+     * The sample rate of the microphone stream is changed to match the recording.
+     */
+    bool start_recording(const std::string &filename, const AudioInfo &info,
+                         YAudio::recording_codec codec);
+
     /*
      *  This function stops recording audio from the microphone.
      */
@@ -181,6 +457,13 @@ class YBoardV3 {
      */
     bool is_recording();
 
+    /*
+     * This function returns the number of times audio from the microphone was lost during the
+     * current or last recording, because the microSD card couldn't keep up. A recording with 0
+     * overruns has no gaps in it.
+     */
+    uint32_t get_recording_overruns();
+
     /*
      *  This function sets the volume of the microphone when recording. The volume is
      * an integer between 0 and 12. A volume of 0 is off, and a volume of 12 is full volume.
@@ -192,16 +475,28 @@ class YBoardV3 {
      * control of the microphone, beyond recording to a file, which this
      * library already provides. This is an advanced function. To see what you
      * can do with a microphone stream object, you can view
-     * https://github.com/pschatzmann/arduino-audio-tools.
+     * https://github.com/pschatzmann/arduino-audio-tools. Don't read from the stream while
+     * recording or while a microphone callback is set, as they already read from it.
      */
     I2SStream &get_microphone_stream();
 
+    /*
+     * This function sets a function to be called with the audio from the microphone, for
+     * processing it as it is heard (for example, measuring how loud it is). The function is
+     * given 256 samples at a time, each a 16-bit number, with the recording volume
+     * already applied. The samples are 44100 per second, or the sample rate of the
+     * recording while one is running. The function runs in the background alongside loop,
+     * so it should finish quickly, and it keeps being called while recording. The arg
+     * value is passed along to the function. Pass NULL as the callback to stop.
+     */
+    void set_microphone_callback(YAudio::mic_frame_callback callback, void *arg);
+
     ///////////////////////////// Accelerometer ////////////////////////////////////
     /*
      *  This function returns whether accelerometer data is available.
      *  The bool return type means that this function returns a boolean value (true
-     * or false). True corresponds to accelerometer data being available, and false
-     * corresponds to accelerometer data not being available.
+     * or false). True corresponds to new accelerometer data being available since the
+     * last call to get_accelerometer, and false corresponds to no new data being available.
      */
     bool accelerometer_available();
 
@@ -209,12 +504,141 @@ class YBoardV3 {
      *  This function returns the accelerometer data.
      *  The return type is a struct containing the x, y, and z values of the
      * accelerometer data. These values are floats, representing the acceleration
-     * in the x, y, and z directions, respectively.
+     * in the x, y, and z directions, respectively, in thousandths of a g (1000 is the
+     * pull of gravity). This is the most recent sample from the accelerometer.
      */
     accelerometer_data get_accelerometer();
 
-    // Display
-    Adafruit_SSD1306 display;
+    /*
+     *  This function gets all of the accelerometer samples collected since it was last called,
+     * up to max_samples of them, for programs that need every sample (for example, to record
+     * motion). The samples are copied into the samples array, oldest first, and the return
+     * value is the number of samples copied. Samples are collected at the rate set in
+     * yboard_config (100 per second by default), and up to 256 are kept, so call this often
+     * enough that they don't pile up. For example:
+     *     accelerometer_data samples[32];
+     *     size_t count = Yboard.get_accelerometer_batch(samples, 32);
+     */
+    size_t get_accelerometer_batch(accelerometer_data *samples, size_t max_samples);
+
+    /*
+     *  This function returns the number of accelerometer samples that were lost because
+     * get_accelerometer_batch wasn't called often enough, or the accelerometer couldn't be
+     * read in time.
+     */
+    uint32_t get_accelerometer_overruns();
+
+    /*
+     *  This function gets statistics about an I2C device's use of the bus, such as the display
+     * (display_addr) or the accelerometer (accel_addr). The return type is a boolean value (true
+     * or false). True corresponds to the device being found, and false corresponds to no device
+     * with that address having been set up. The statistics are the number of transactions, how
+     * many of them failed, the total time spent on the bus in microseconds, and the longest time
+     * a transaction waited for the bus and then used it. For example:
+     *     YI2C::device_stats stats;
+     *     if (Yboard.get_i2c_stats(Yboard.display_addr, stats)) {
+     *         Serial.printf("Display used the bus for %llu us\n", stats.bus_time_us);
+     *     }
+     */
+    bool get_i2c_stats(uint8_t address, YI2C::device_stats &stats);
+
+    /*
+     *  This function gets the next motion the accelerometer detected on its own: a tap, a double
+     * tap, a free fall, or the board being turned so a different side faces up. Each detector
+     * has to be turned on in the settings passed to setup first, for example:
+     *     yboard_config config;
+     *     config.accelerometer.detect_taps = true;
+     *     Yboard.setup(config);
+     * The return type is a boolean value (true or false). True corresponds to an event being
+     * returned in event, and false corresponds to nothing having happened since the last call.
+     * Each event says what happened (for example, YAccel::MOTION_TAP), which way (for a tap, the
+     * direction it came from, and for an orientation change, the axis now pointing up), and the
+     * time in milliseconds when it was noticed. For example:
+     *     YAccel::motion_event event;
+     *     while (Yboard.poll_motion_event(event)) {
+     *         if (event.type == YAccel::MOTION_TAP) {
+     *             Serial.println("Tap!");
+     *         }
+     *     }
+     */
+    bool poll_motion_event(YAccel::motion_event &event);
+
+    /*
+     *  This function sets a function to be called with each motion event, instead of getting
+     * them from poll_motion_event. The function runs in the background, so it should finish
+     * quickly. The arg value is passed along to the function. Pass NULL as the callback to go
+     * back to using poll_motion_event.
+     */
+    void set_motion_event_callback(YAccel::motion_event_callback callback, void *arg = NULL);
+
+    ////////////////////////////// microSD Card ////////////////////////////////////
+
+    /*
+     *  This function measures how fast the microSD card can be written and read, by writing a
+     * test file of test_size_kb kilobytes, reading it back, and deleting it. This is useful for
+     * checking that a card is fast enough before using it for recordings. The return type is a
+     * boolean value (true or false). True corresponds to the test finishing and the speeds being
+     * returned in result, and false corresponds to the card being missing, full, or returning
+     * different data than was written. For example:
+     *     sd_card_speed speed;
+     *     if (Yboard.test_sd_card_speed(speed)) {
+     *         Serial.printf("Write: %u KB/s, Read: %u KB/s\n", speed.write_kb_per_second,
+     *                       speed.read_kb_per_second);
+     *     }
+     */
+    bool test_sd_card_speed(sd_card_speed &result, size_t test_size_kb = 1024);
+
+    /*
+     *  This function returns the file system for the microSD card, which is SD or SD_MMC
+     * depending on how the card was set up. Files opened through it work with either driver. For
+     * example:
+     *     File file = Yboard.get_file_system().open("/notes.txt");
+     */
+    fs::FS &get_file_system();
+
+    ////////////////////////////// Power /////////////////////////////////////////
+
+    /*
+     *  This function turns on low power mode, which saves battery while the YBoard has nothing to
+     * do. The speaker and microphone are powered down after they have been unused for a while, and
+     * start up again the next time a sound is played or a recording is started. It also lets
+     * light_sleep be used. The streams from get_speaker_stream and get_microphone_stream can't be
+     * used directly in low power mode. For example:
+     *     low_power_config config;
+     *     config.audio_idle_ms = 500;
+     *     Yboard.enable_low_power(config);
+     */
+    void enable_low_power(const low_power_config &config = low_power_config());
+
+    /*
+     *  This function returns whether the YBoard is idle, which is when light_sleep can be used.
+     * The return type is a boolean value (true or false). True corresponds to low power mode being
+     * on, the speaker and microphone being powered down, and the LEDs and display not being
+     * updated. False corresponds to something still being busy.
+     */
+    bool is_idle();
+
+    /*
+     *  This function puts the YBoard into light sleep until a button is pressed or released, a
+     * switch is flipped, or the accelerometer interrupts (depending on the low_power_config), or
+     * until timeout_ms milliseconds have passed. Everything stops while the YBoard sleeps, and
+     * picks up where it left off when it wakes, so it can be called at the end of loop. The
+     * return type is a boolean value (true or false). True corresponds to the YBoard having
+     * slept, and false corresponds to it not being idle, in which case it returns right away. For
+     * example:
+     *     void loop() {
+     *         YInputs::input_event event;
+     *         while (Yboard.poll_input_event(event)) {
+     *             Yboard.play_notes_background("C D E");
+     *         }
+     *         Yboard.light_sleep();
+     *     }
+     */
+    bool light_sleep(uint32_t timeout_ms = UINT32_MAX);
+
+    // Display. display.display() only sends the parts of the screen that changed, and returns
+    // before they are sent. Call display.wait_for_flush() to wait for them.
+    YDisplay display;
 
     // LEDs
     static constexpr int led_pin = 5;
@@ -230,9 +654,11 @@ class YBoardV3 {
     // I2C Connections
     static constexpr int sda_pin = 2;
     static constexpr int scl_pin = 1;
+    static constexpr uint32_t i2c_frequency = 400000;
 
     // I2C Devices
     static constexpr int accel_addr = 0x19;
+    static constexpr int display_addr = 0x3c;
 
     // microSD Card Reader connections
     static constexpr int sd_cs_pin = 10;
@@ -253,18 +679,41 @@ class YBoardV3 {
 
   private:
     Adafruit_NeoPixel strip;
-    SPARKFUN_LIS2DH12 accel;
-    bool wire_begin = false;
+    uint8_t shown_pixels[led_count * 3] = {};
+    bool leds_shown = false;
+    bool led_frame_active = false;
+    bool leds_async = false;
+    bool knob_sampled = false;
     bool sd_card_present = false;
+    fs::FS *file_system = &SD;
+    bool low_power_enabled = false;
+    low_power_config power_config;
+
+    // Setup progress. The low bits are set when a subsystem finishes setting up, and the same
+    // bits shifted up by SETUP_OK_SHIFT are set if it succeeded.
+    static constexpr int SETUP_OK_SHIFT = 8;
+    EventGroupHandle_t setup_events = NULL;
+    yboard_config setup_config;
+
+    static void storage_setup_task(void *params);
+    static void audio_setup_task(void *params);
+    static void i2c_setup_task(void *params);
+    void setup_storage();
+    void setup_audio();
+    void setup_i2c_devices();
+    void report_setup(yboard_subsystem subsystem, bool ok, const char *name);
 
     void setup_leds();
+    void show_leds();
     void setup_switches();
     void setup_buttons();
-    bool setup_speaker();
-    bool setup_mic();
-    bool setup_accelerometer();
-    bool setup_sd_card();
-    bool setup_display();
+    void setup_knob();
+    bool setup_speaker(const YAudio::audio_config &config);
+    bool setup_mic(const YAudio::audio_config &config);
+    void setup_i2c();
+    bool setup_accelerometer(const YAccel::accelerometer_config &config);
+    bool setup_sd_card(const sd_card_config &config);
+    bool setup_display(const display_config &config);
 };
 
 extern YBoardV3 Yboard;
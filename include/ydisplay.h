@@ -0,0 +1,62 @@
+#ifndef YDISPLAY_H
+#define YDISPLAY_H
+
+#include <Adafruit_SSD1306.h>
+#include <Arduino.h>
+#include <Wire.h>
+
+#include "yi2c.h"
+
+// Only the parts of the screen that changed since the last call to display() are sent. With
+// async on, display() returns right away and a background task sends them.
+//
+// Frames are sent as low priority YI2C transactions at i2c_clock, so sensor reads can go in
+// between them. The SSD1306 is rated for 400 kHz, though most panels work at 1 MHz. The clock is
+// only raised for the display's own transactions.
+struct display_config {
+    uint32_t i2c_clock = 400000;
+    bool async = true;
+};
+
+class YDisplay : public Adafruit_SSD1306 {
+  public:
+    YDisplay(uint8_t w, uint8_t h, TwoWire *twi = &Wire);
+    ~YDisplay();
+
+    bool begin(uint8_t switchvcc, uint8_t i2caddr, const display_config &config);
+
+    // Replaces Adafruit_SSD1306::display, which always sends the whole screen
+    void display();
+    bool is_flushing();
+    void wait_for_flush();
+
+    // Replace the Adafruit_SSD1306 versions, which use Wire directly, with YI2C transactions
+    void ssd1306_command(uint8_t c);
+    void invertDisplay(bool i);
+    void dim(bool dim);
+    void startscrollright(uint8_t start, uint8_t stop);
+    void startscrollleft(uint8_t start, uint8_t stop);
+    void startscrolldiagright(uint8_t start, uint8_t stop);
+    void startscrolldiagleft(uint8_t start, uint8_t stop);
+    void stopscroll();
+
+  private:
+    size_t frame_bytes = 0;
+    uint8_t *sent_frame = NULL;
+    uint8_t *pending_frame = NULL;
+    uint8_t *working_frame = NULL;
+    bool sent_valid = false;
+    bool frame_pending = false;
+    bool flushing = false;
+    portMUX_TYPE frame_lock = portMUX_INITIALIZER_UNLOCKED;
+    TaskHandle_t flush_task_handle = NULL;
+
+    static void flush_task(void *params);
+    bool take_pending_frame();
+    void send_changes(const uint8_t *frame);
+    bool send_window(uint8_t page, uint8_t first_column, uint8_t last_column,
+                     const uint8_t *data);
+    bool send_commands(const uint8_t *commands, size_t count);
+};
+
+#endif /* YDISPLAY_H */
@@ -0,0 +1,34 @@
+#ifndef YDSP_H
+#define YDSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Block-based int16 audio kernels. On the ESP32-S3, mix and apply_gain use the esp-dsp vector
+// code when the buffer they write to is 16-byte aligned, and the scalar loops for anything left.
+namespace YDSP {
+
+// Gains are fixed point. 1.0 is Q15_ONE for attenuation, and Q8_ONE where boost is allowed.
+static const int32_t Q15_ONE = 1 << 15;
+static const int32_t Q8_ONE = 1 << 8;
+
+struct dc_filter_state {
+    int32_t previous_input;
+    int32_t previous_output;
+};
+
+inline int16_t saturate(int32_t sample) {
+    return sample > INT16_MAX ? INT16_MAX : (sample < INT16_MIN ? INT16_MIN : sample);
+}
+
+void apply_gain(int16_t *samples, size_t num_samples, int32_t gain_q8);
+void mix(int16_t *mix, const int16_t *samples, size_t num_samples, int32_t gain_q15);
+
+// The portable versions of the above, which give the same results on every target
+void apply_gain_scalar(int16_t *samples, size_t num_samples, int32_t gain_q8);
+void mix_scalar(int16_t *mix, const int16_t *samples, size_t num_samples, int32_t gain_q15);
+void fade(int16_t *samples, size_t num_samples, int32_t start_gain_q15, int32_t end_gain_q15);
+void remove_dc(int16_t *samples, size_t num_samples, dc_filter_state &state);
+}; // namespace YDSP
+
+#endif /* YDSP_H */
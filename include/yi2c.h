@@ -0,0 +1,37 @@
+#ifndef YI2C_H
+#define YI2C_H
+
+#include <Wire.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace YI2C {
+
+// Transactions for high priority devices go ahead of any waiting low priority ones. Long
+// transfers, like display frames, should be low priority and sent as several transactions, so
+// short sensor reads get the bus in between.
+enum transaction_priority { PRIORITY_HIGH, PRIORITY_LOW };
+
+struct device_stats {
+    uint32_t transactions;
+    uint32_t errors;
+    uint64_t bus_time_us;  // Total time spent on the bus
+    uint32_t max_wait_us;  // Longest a transaction waited for the bus
+    uint32_t max_busy_us;  // Longest a transaction held the bus
+};
+
+bool setup(TwoWire &wire, int sda, int scl, uint32_t frequency);
+bool add_device(uint8_t address, uint32_t clock, transaction_priority priority);
+bool write(uint8_t address, const uint8_t *data, size_t length);
+bool write_read(uint8_t address, const uint8_t *tx_data, size_t tx_length, uint8_t *rx_data,
+                size_t rx_length);
+bool get_stats(uint8_t address, device_stats &stats);
+
+// Holds the bus idle from when the transaction in progress finishes until resume is called, such
+// as while the board is asleep. Transactions started in the meantime wait for resume. Only one
+// task can pause the bus at a time.
+bool pause();
+void resume();
+}; // namespace YI2C
+
+#endif /* YI2C_H */
@@ -0,0 +1,38 @@
+#ifndef YINPUTS_H
+#define YINPUTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace YInputs {
+
+enum input_id { INPUT_BUTTON_1, INPUT_BUTTON_2, INPUT_SWITCH_1, INPUT_SWITCH_2, NUM_INPUTS };
+
+// Switches report PRESSED when they are turned on and RELEASED when they are turned off. Only
+// inputs set up with long presses enabled report LONG_PRESS.
+enum input_event_type { INPUT_PRESSED, INPUT_RELEASED, INPUT_LONG_PRESS };
+
+struct input_event {
+    input_id input;
+    input_event_type type;
+    uint32_t timestamp; // millis() when the input first changed
+};
+
+typedef void (*input_event_callback)(const input_event &event, void *arg);
+typedef void (*knob_callback)(int value, void *arg);
+
+bool setup_input(input_id input, int pin, bool active_low, bool long_press);
+bool poll_event(input_event &event);
+void set_event_callback(input_event_callback callback, void *arg);
+bool setup_knob(int pin, int reading_at_0, int reading_at_100);
+int get_knob();
+void set_knob_callback(knob_callback callback, int threshold, void *arg);
+
+// Light sleep stops the pin interrupts, so the inputs wake the board instead. Each input wakes it
+// when its pin changes from the level it is at now. end_wakeup goes back to pin interrupts, and
+// reports any change that woke the board.
+bool enable_wakeup(input_id input);
+void end_wakeup();
+}; // namespace YInputs
+
+#endif /* YINPUTS_H */
@@ -0,0 +1,55 @@
+#ifndef YLEDS_H
+#define YLEDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace YLeds {
+
+static const int MAX_ANIMATIONS = 4;
+static const int MAX_KEYFRAMES = 8;
+
+struct keyframe {
+    uint32_t time_ms; // From the start of the animation
+    uint8_t red;
+    uint8_t green;
+    uint8_t blue;
+};
+
+// EFFECT_KEYFRAMES fades every LED through the keyframes together. EFFECT_CHASE does the same,
+// but each LED runs led_offset_ms behind the one before it. EFFECT_RAINBOW ignores the keyframes
+// and moves a rainbow across the LEDs once every period_ms.
+enum animation_effect { EFFECT_KEYFRAMES, EFFECT_CHASE, EFFECT_RAINBOW };
+
+// An animation covers num_leds LEDs starting at first_led, counting from 0, or all the LEDs from
+// first_led on if num_leds is 0. With repeat on, it starts over every period_ms, fading from the
+// last keyframe back to the first. Otherwise, it holds the last keyframe's color until it is
+// stopped. The keyframes must be in time order.
+struct animation {
+    animation_effect effect = EFFECT_KEYFRAMES;
+    keyframe keyframes[MAX_KEYFRAMES] = {};
+    int num_keyframes = 0;
+    uint32_t period_ms = 1000;
+    uint32_t led_offset_ms = 0;
+    bool repeat = true;
+    int first_led = 0;
+    int num_leds = 0;
+};
+
+bool setup_async_output(int pin, size_t num_bytes);
+void show_async(const uint8_t *pixels);
+bool is_showing();
+
+// Animations are drawn by a hardware timer at frame_rate frames per second, on top of the last
+// frame from show_async, and sent as one frame each tick. While any are playing, show_async only
+// changes the frame they are drawn over. Animation colors are gamma corrected, so fades look
+// even, and then scaled by the brightness. Frames are GRB, like the YBoard's LEDs.
+bool setup_animations(int frame_rate);
+int start_animation(const animation &animation);
+void stop_animation(int id);
+void stop_all_animations();
+bool is_animating();
+void set_animation_brightness(uint8_t brightness);
+}; // namespace YLeds
+
+#endif /* YLEDS_H */
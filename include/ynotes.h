@@ -0,0 +1,53 @@
+#ifndef YNOTES_H
+#define YNOTES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compiles note strings, like "T120 O5 C D E (C E G)2", into notes for the speaker. This is pure
+// logic with no Arduino or FreeRTOS dependencies, so it can also be built and measured natively.
+namespace YNotes {
+
+// Number of notes that can be played at the same time in a chord
+static const int MAX_VOICES = 4;
+
+enum waveform : uint8_t { WAVE_SINE, WAVE_SQUARE, WAVE_TRIANGLE, WAVE_SAWTOOTH, NUM_WAVEFORMS };
+
+struct note {
+    uint16_t frequency[MAX_VOICES]; // 0 for unused voices, all 0 for a rest
+    uint32_t duration;              // in samples
+    uint8_t volume;
+    waveform wave;
+};
+
+// Settings that carry over from one string of notes to the next, until they are changed or reset
+// with '!'
+struct note_state {
+    int beats_per_minute = 120;
+    int octave = 5;
+    int volume = 5;
+    waveform wave = WAVE_SINE;
+};
+
+// The notes are written to a ring buffer of queue_size notes. The indices count up forever and
+// are wrapped when used to index the queue, so tail - head is the number of notes in it.
+struct note_queue {
+    note *notes;
+    uint32_t queue_size;
+    uint32_t head;
+    uint32_t tail;
+};
+
+enum compile_result {
+    COMPILE_OK,
+    COMPILE_SYNTAX_ERROR, // The notes before the error were added
+    COMPILE_QUEUE_FULL,   // Some of the notes may have been added, up to the end of the queue
+};
+
+// Compiles the notes onto the tail of the queue, and updates the state. For a syntax error,
+// error_at points to where in the notes it is.
+compile_result compile(const char *notes, note_state &state, uint32_t sample_rate,
+                       note_queue &queue, const char **error_at = NULL);
+}; // namespace YNotes
+
+#endif /* YNOTES_H */
@@ -0,0 +1,485 @@
+#include "yaccel.h"
+
+#include <Arduino.h>
+#include <atomic>
+#include <driver/gpio.h>
+
+#include "yi2c.h"
+
+namespace YAccel {
+
+///////////////////////////////// Configuration Constants //////////////////////
+
+// LIS2DH12 registers
+static const uint8_t WHO_AM_I = 0x0F;
+static const uint8_t CTRL_REG1 = 0x20;
+static const uint8_t CTRL_REG3 = 0x22;
+static const uint8_t CTRL_REG4 = 0x23;
+static const uint8_t CTRL_REG5 = 0x24;
+static const uint8_t OUT_X_L = 0x28;
+static const uint8_t FIFO_CTRL_REG = 0x2E;
+static const uint8_t FIFO_SRC_REG = 0x2F;
+static const uint8_t INT1_CFG = 0x30;
+static const uint8_t INT1_SRC = 0x31;
+static const uint8_t INT1_THS = 0x32;
+static const uint8_t INT1_DURATION = 0x33;
+static const uint8_t INT2_CFG = 0x34;
+static const uint8_t INT2_SRC = 0x35;
+static const uint8_t INT2_THS = 0x36;
+static const uint8_t INT2_DURATION = 0x37;
+static const uint8_t CLICK_CFG = 0x38;
+static const uint8_t CLICK_SRC = 0x39;
+static const uint8_t CLICK_THS = 0x3A;
+static const uint8_t TIME_LIMIT = 0x3B;
+static const uint8_t TIME_LATENCY = 0x3C;
+static const uint8_t TIME_WINDOW = 0x3D;
+
+static const uint8_t WHO_AM_I_VALUE = 0x33;
+static const uint8_t AUTO_INCREMENT = 0x80; // Set in the register address for multi-byte reads
+
+static const uint8_t CTRL_REG1_XYZ_EN = 0x07;
+static const uint8_t CTRL_REG3_I1_CLICK = 0x80;
+static const uint8_t CTRL_REG3_I1_IA1 = 0x40;
+static const uint8_t CTRL_REG3_I1_IA2 = 0x20;
+static const uint8_t CTRL_REG3_I1_WTM = 0x04;
+static const uint8_t CTRL_REG4_BDU = 0x80;
+static const uint8_t CTRL_REG4_HR = 0x08; // 12-bit samples, 1 mg each at +/-2 g
+static const uint8_t CTRL_REG5_FIFO_EN = 0x40;
+static const uint8_t CTRL_REG5_LIR_INT1 = 0x08;
+static const uint8_t CTRL_REG5_LIR_INT2 = 0x02;
+
+// The interrupt generators compare each axis against the threshold. Free-fall is all three axes
+// low at once. Orientation uses the 6D mode, which triggers when a different axis points up.
+static const uint8_t INT_CFG_AOI = 0x80;
+static const uint8_t INT_CFG_6D = 0x40;
+static const uint8_t INT_CFG_ALL_LOW = 0x15;
+static const uint8_t INT_CFG_ALL = 0x3F;
+static const uint8_t INT_SRC_IA = 0x40;
+static const uint8_t INT_SRC_XL = 0x01;
+static const uint8_t INT_SRC_XH = 0x02;
+static const uint8_t INT_SRC_YL = 0x04;
+static const uint8_t INT_SRC_YH = 0x08;
+static const uint8_t INT_SRC_ZL = 0x10;
+static const uint8_t INT_SRC_ZH = 0x20;
+
+static const uint8_t CLICK_CFG_SINGLE_ALL = 0x15;
+static const uint8_t CLICK_CFG_DOUBLE_ALL = 0x2A;
+static const uint8_t CLICK_THS_LIR = 0x80;
+static const uint8_t CLICK_SRC_IA = 0x40;
+static const uint8_t CLICK_SRC_DCLICK = 0x20;
+static const uint8_t CLICK_SRC_SCLICK = 0x10;
+static const uint8_t CLICK_SRC_SIGN = 0x08;
+static const uint8_t CLICK_SRC_Z = 0x04;
+static const uint8_t CLICK_SRC_Y = 0x02;
+
+// Threshold registers count in steps of 16 mg at +/-2 g
+static const int THRESHOLD_MG_PER_STEP = 16;
+
+// Timing of the motion detectors, converted to samples at the output data rate
+static const int TAP_LIMIT_MS = 50;    // Longest a tap can last
+static const int TAP_LATENCY_MS = 100; // Quiet time after a tap before a second one counts
+static const int TAP_WINDOW_MS = 300;  // Time after that for the second tap of a double tap
+static const int FREE_FALL_MS = 30;
+static const int ORIENTATION_MS = 100;
+static const int ORIENTATION_THRESHOLD_MG = 500;
+
+// Number of motion events that can be waiting for poll_motion_event
+static const int MAX_MOTION_EVENTS = 16;
+static const uint8_t FIFO_MODE_STREAM = 0x80;
+static const uint8_t FIFO_SRC_OVRN = 0x40;
+static const uint8_t FIFO_SRC_FSS = 0x1F;
+
+// Output data rates, and the CTRL_REG1 ODR value for each
+static const int RATES[] = {1, 10, 25, 50, 100, 200, 400, 1344};
+static const uint8_t RATE_CODES[] = {1, 2, 3, 4, 5, 6, 7, 9};
+static const int NUM_RATES = sizeof(RATES) / sizeof(RATES[0]);
+
+static const int BYTES_PER_SAMPLE = 6;
+
+// The LIS2DH12 is rated for 400 kHz
+static const uint32_t ACCEL_I2C_CLOCK = 400000;
+
+// The Wire buffer holds 128 bytes, so longer bursts are split into several reads
+static const int MAX_SAMPLES_PER_READ = 128 / BYTES_PER_SAMPLE;
+
+// Must be a power of two so the ring indices can wrap around
+static const uint32_t RING_SIZE = 256;
+
+// The reader task runs on core 0, away from the Arduino loop on core 1
+static const BaseType_t ACCEL_TASK_CORE = 0;
+static const UBaseType_t ACCEL_TASK_PRIORITY = 2;
+
+// Samples read from the FIFO. The reader task is the only writer of the tail and get_batch is the
+// only writer of the head. Like the note queue, the indices count up forever and are wrapped when
+// used to index the ring. If the ring is full, new samples are dropped and counted.
+static accelerometer_data ring[RING_SIZE];
+static std::atomic<uint32_t> ring_head(0);
+static std::atomic<uint32_t> ring_tail(0);
+static std::atomic<uint32_t> overruns(0);
+
+// The newest sample, for get_latest
+static accelerometer_data latest = {0, 0, 0};
+static bool latest_unread = false;
+static portMUX_TYPE latest_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t bus_address;
+static TaskHandle_t accel_task_handle;
+static TickType_t poll_period;
+static int int_pin = -1;
+static bool wakeup_enabled = false;
+
+// Motion events. They are latched on the accelerometer until the reader task reads them.
+static bool taps_enabled = false;
+static bool free_fall_enabled = false;
+static bool orientation_enabled = false;
+static QueueHandle_t motion_events;
+static motion_event_callback motion_callback = NULL;
+static void *motion_callback_arg = NULL;
+static portMUX_TYPE motion_callback_lock = portMUX_INITIALIZER_UNLOCKED;
+
+//////////////////////////// Private Function Prototypes ///////////////////////
+static void accel_task(void *params);
+static void IRAM_ATTR accel_isr();
+static int read_fifo();
+static bool setup_motion(const accelerometer_config &config, int rate);
+static bool read_motion_events();
+static void report_motion_event(motion_event_type type, motion_direction direction);
+static motion_direction int_src_direction(uint8_t src);
+static uint8_t threshold_steps(int mg);
+static uint8_t duration_samples(int ms, int rate, int max_samples);
+static bool write_register(uint8_t reg, uint8_t value);
+static bool read_registers(uint8_t reg, uint8_t *data, size_t len);
+
+////////////////////////////// Public Functions ///////////////////////////////
+bool setup(uint8_t address, const accelerometer_config &config) {
+    // Sensor reads are short, so they go ahead of display transfers
+    bus_address = address;
+    if (!YI2C::add_device(address, ACCEL_I2C_CLOCK, YI2C::PRIORITY_HIGH)) {
+        return false;
+    }
+
+    uint8_t id = 0;
+    if (!read_registers(WHO_AM_I, &id, 1) || id != WHO_AM_I_VALUE) {
+        return false;
+    }
+
+    int rate_index = 0;
+    while (rate_index < NUM_RATES - 1 && RATES[rate_index] < config.rate) {
+        rate_index++;
+    }
+    uint8_t watermark = constrain(config.watermark, 1, 31);
+
+    // Collect samples in the FIFO, replacing the oldest when it is full, and raise INT1 at the
+    // watermark
+    if (!write_register(CTRL_REG1, (RATE_CODES[rate_index] << 4) | CTRL_REG1_XYZ_EN) ||
+        !write_register(CTRL_REG4, CTRL_REG4_BDU | CTRL_REG4_HR) ||
+        !write_register(FIFO_CTRL_REG, FIFO_MODE_STREAM | watermark) ||
+        !setup_motion(config, RATES[rate_index])) {
+        return false;
+    }
+
+    // Check at twice the rate the watermark fills up, or as a fallback in case an interrupt is
+    // missed
+    poll_period = max(pdMS_TO_TICKS(watermark * 1000 / RATES[rate_index] / 2), (TickType_t)1);
+
+    int_pin = config.int_pin;
+    if (xTaskCreatePinnedToCore(accel_task, "accel_task", 3072, NULL, ACCEL_TASK_PRIORITY,
+                                &accel_task_handle, ACCEL_TASK_CORE) != pdPASS) {
+        return false;
+    }
+
+    if (int_pin >= 0) {
+        pinMode(int_pin, INPUT);
+        attachInterrupt(int_pin, accel_isr, RISING);
+    }
+
+    return true;
+}
+
+bool available() {
+    portENTER_CRITICAL(&latest_lock);
+    bool unread = latest_unread;
+    portEXIT_CRITICAL(&latest_lock);
+    return unread;
+}
+
+accelerometer_data get_latest() {
+    portENTER_CRITICAL(&latest_lock);
+    accelerometer_data data = latest;
+    latest_unread = false;
+    portEXIT_CRITICAL(&latest_lock);
+    return data;
+}
+
+size_t get_batch(accelerometer_data *samples, size_t max_samples) {
+    uint32_t head = ring_head.load(std::memory_order_relaxed);
+    uint32_t tail = ring_tail.load(std::memory_order_acquire);
+    size_t count = min((size_t)(tail - head), max_samples);
+
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = ring[(head + i) % RING_SIZE];
+    }
+    ring_head.store(head + count, std::memory_order_release);
+
+    return count;
+}
+
+uint32_t get_overruns() { return overruns; }
+
+bool poll_motion_event(motion_event &event) {
+    return motion_events && xQueueReceive(motion_events, &event, 0) == pdTRUE;
+}
+
+void set_motion_event_callback(motion_event_callback callback, void *arg) {
+    portENTER_CRITICAL(&motion_callback_lock);
+    motion_callback = callback;
+    motion_callback_arg = arg;
+    portEXIT_CRITICAL(&motion_callback_lock);
+}
+
+bool enable_wakeup() {
+    if (int_pin < 0) {
+        return false;
+    }
+
+    // Waking is level triggered, and replaces the pin's interrupt type, so the edge interrupt is
+    // turned off until end_wakeup
+    gpio_intr_disable((gpio_num_t)int_pin);
+    if (gpio_wakeup_enable((gpio_num_t)int_pin, GPIO_INTR_HIGH_LEVEL) != ESP_OK) {
+        gpio_intr_enable((gpio_num_t)int_pin);
+        return false;
+    }
+    wakeup_enabled = true;
+
+    return true;
+}
+
+void end_wakeup() {
+    if (!wakeup_enabled) {
+        return;
+    }
+
+    gpio_wakeup_disable((gpio_num_t)int_pin);
+    gpio_set_intr_type((gpio_num_t)int_pin, GPIO_INTR_POSEDGE);
+    gpio_intr_enable((gpio_num_t)int_pin);
+    wakeup_enabled = false;
+
+    // The rising edge may have come while asleep, so have the task check for samples and events
+    xTaskNotifyGive(accel_task_handle);
+}
+
+////////////////////////////// Private Functions ///////////////////////////////
+
+void accel_task(void *params) {
+    while (1) {
+        // Block waiting for the watermark interrupt, or poll if there isn't one
+        if (int_pin >= 0) {
+            ulTaskNotifyTake(pdTRUE, poll_period * 4);
+        } else {
+            vTaskDelay(poll_period);
+        }
+
+        // If the interrupt is still high, more samples or events came in while they were being
+        // read. Keep reading until it goes low, so that it can rise again.
+        bool read_any;
+        do {
+            read_any = read_fifo() > 0;
+            read_any |= read_motion_events();
+        } while (read_any && int_pin >= 0 && digitalRead(int_pin));
+    }
+}
+
+void IRAM_ATTR accel_isr() {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(accel_task_handle, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+// Reads everything in the FIFO into the ring, and returns the number of samples read
+int read_fifo() {
+    uint8_t fifo_src;
+    if (!read_registers(FIFO_SRC_REG, &fifo_src, 1)) {
+        return 0;
+    }
+
+    // The FIFO dropped samples before they could be read
+    if (fifo_src & FIFO_SRC_OVRN) {
+        overruns++;
+    }
+
+    int num_samples = fifo_src & FIFO_SRC_FSS;
+    int count = 0;
+    while (count < num_samples) {
+        // Read as many samples as fit in one transfer. Each is X, Y, Z, left justified.
+        uint8_t data[MAX_SAMPLES_PER_READ * BYTES_PER_SAMPLE];
+        int n = min(num_samples - count, MAX_SAMPLES_PER_READ);
+        if (!read_registers(OUT_X_L | AUTO_INCREMENT, data, n * BYTES_PER_SAMPLE)) {
+            break;
+        }
+
+        uint32_t tail = ring_tail.load(std::memory_order_relaxed);
+        uint32_t head = ring_head.load(std::memory_order_acquire);
+        accelerometer_data sample = {0, 0, 0};
+        for (int i = 0; i < n; i++) {
+            const uint8_t *p = data + i * BYTES_PER_SAMPLE;
+            sample.x = (int16_t)(p[0] | (p[1] << 8)) >> 4;
+            sample.y = (int16_t)(p[2] | (p[3] << 8)) >> 4;
+            sample.z = (int16_t)(p[4] | (p[5] << 8)) >> 4;
+
+            if (tail - head < RING_SIZE) {
+                ring[tail % RING_SIZE] = sample;
+                tail++;
+            } else {
+                overruns++;
+            }
+        }
+        ring_tail.store(tail, std::memory_order_release);
+
+        portENTER_CRITICAL(&latest_lock);
+        latest = sample;
+        latest_unread = true;
+        portEXIT_CRITICAL(&latest_lock);
+
+        count += n;
+    }
+
+    return count;
+}
+
+// Sets up the motion detectors, and routes them along with the FIFO watermark to INT1. The
+// detectors are latched, so none are missed between reads.
+bool setup_motion(const accelerometer_config &config, int rate) {
+    uint8_t ctrl_reg3 = CTRL_REG3_I1_WTM;
+    uint8_t ctrl_reg5 = CTRL_REG5_FIFO_EN;
+
+    taps_enabled = config.detect_taps || config.detect_double_taps;
+    if (taps_enabled) {
+        uint8_t click_cfg = (config.detect_taps ? CLICK_CFG_SINGLE_ALL : 0) |
+                            (config.detect_double_taps ? CLICK_CFG_DOUBLE_ALL : 0);
+        if (!write_register(CLICK_CFG, click_cfg) ||
+            !write_register(CLICK_THS, CLICK_THS_LIR | threshold_steps(config.tap_threshold)) ||
+            !write_register(TIME_LIMIT, duration_samples(TAP_LIMIT_MS, rate, 127)) ||
+            !write_register(TIME_LATENCY, duration_samples(TAP_LATENCY_MS, rate, 255)) ||
+            !write_register(TIME_WINDOW, duration_samples(TAP_WINDOW_MS, rate, 255))) {
+            return false;
+        }
+        ctrl_reg3 |= CTRL_REG3_I1_CLICK;
+    }
+
+    free_fall_enabled = config.detect_free_fall;
+    if (free_fall_enabled) {
+        if (!write_register(INT1_CFG, INT_CFG_AOI | INT_CFG_ALL_LOW) ||
+            !write_register(INT1_THS, threshold_steps(config.free_fall_threshold)) ||
+            !write_register(INT1_DURATION, duration_samples(FREE_FALL_MS, rate, 127))) {
+            return false;
+        }
+        ctrl_reg3 |= CTRL_REG3_I1_IA1;
+        ctrl_reg5 |= CTRL_REG5_LIR_INT1;
+    }
+
+    orientation_enabled = config.detect_orientation;
+    if (orientation_enabled) {
+        if (!write_register(INT2_CFG, INT_CFG_6D | INT_CFG_ALL) ||
+            !write_register(INT2_THS, threshold_steps(ORIENTATION_THRESHOLD_MG)) ||
+            !write_register(INT2_DURATION, duration_samples(ORIENTATION_MS, rate, 127))) {
+            return false;
+        }
+        ctrl_reg3 |= CTRL_REG3_I1_IA2;
+        ctrl_reg5 |= CTRL_REG5_LIR_INT2;
+    }
+
+    if (taps_enabled || free_fall_enabled || orientation_enabled) {
+        motion_events = xQueueCreate(MAX_MOTION_EVENTS, sizeof(motion_event));
+        if (!motion_events) {
+            return false;
+        }
+    }
+
+    return write_register(CTRL_REG5, ctrl_reg5) && write_register(CTRL_REG3, ctrl_reg3);
+}
+
+// Reads the motion detectors, which also clears them, and reports what they saw. Returns whether
+// there were any events.
+bool read_motion_events() {
+    bool any = false;
+    uint8_t src;
+
+    if (taps_enabled && read_registers(CLICK_SRC, &src, 1) && (src & CLICK_SRC_IA)) {
+        motion_direction direction = (src & CLICK_SRC_Z)   ? DIRECTION_Z_POSITIVE
+                                     : (src & CLICK_SRC_Y) ? DIRECTION_Y_POSITIVE
+                                                           : DIRECTION_X_POSITIVE;
+        if (src & CLICK_SRC_SIGN) {
+            direction = (motion_direction)(direction + 1);
+        }
+        if (src & CLICK_SRC_DCLICK) {
+            report_motion_event(MOTION_DOUBLE_TAP, direction);
+        } else if (src & CLICK_SRC_SCLICK) {
+            report_motion_event(MOTION_TAP, direction);
+        }
+        any = true;
+    }
+
+    if (free_fall_enabled && read_registers(INT1_SRC, &src, 1) && (src & INT_SRC_IA)) {
+        report_motion_event(MOTION_FREE_FALL, DIRECTION_NONE);
+        any = true;
+    }
+
+    if (orientation_enabled && read_registers(INT2_SRC, &src, 1) && (src & INT_SRC_IA)) {
+        report_motion_event(MOTION_ORIENTATION, int_src_direction(src));
+        any = true;
+    }
+
+    return any;
+}
+
+// Passes the event to the callback if there is one, and otherwise queues it for
+// poll_motion_event. If the queue is full, the event is dropped.
+void report_motion_event(motion_event_type type, motion_direction direction) {
+    motion_event event = {type, direction, (uint32_t)millis()};
+
+    portENTER_CRITICAL(&motion_callback_lock);
+    motion_event_callback callback = motion_callback;
+    void *callback_arg = motion_callback_arg;
+    portEXIT_CRITICAL(&motion_callback_lock);
+
+    if (callback) {
+        callback(event, callback_arg);
+    } else {
+        xQueueSend(motion_events, &event, 0);
+    }
+}
+
+// Returns the axis an interrupt generator saw past the threshold, which in 6D mode is the one
+// pointing up
+motion_direction int_src_direction(uint8_t src) {
+    if (src & INT_SRC_XH) {
+        return DIRECTION_X_POSITIVE;
+    } else if (src & INT_SRC_XL) {
+        return DIRECTION_X_NEGATIVE;
+    } else if (src & INT_SRC_YH) {
+        return DIRECTION_Y_POSITIVE;
+    } else if (src & INT_SRC_YL) {
+        return DIRECTION_Y_NEGATIVE;
+    } else if (src & INT_SRC_ZH) {
+        return DIRECTION_Z_POSITIVE;
+    } else if (src & INT_SRC_ZL) {
+        return DIRECTION_Z_NEGATIVE;
+    }
+    return DIRECTION_NONE;
+}
+
+uint8_t threshold_steps(int mg) { return constrain(mg / THRESHOLD_MG_PER_STEP, 1, 127); }
+
+uint8_t duration_samples(int ms, int rate, int max_samples) {
+    return constrain(ms * rate / 1000, 1, max_samples);
+}
+
+bool write_register(uint8_t reg, uint8_t value) {
+    uint8_t data[2] = {reg, value};
+    return YI2C::write(bus_address, data, sizeof(data));
+}
+
+bool read_registers(uint8_t reg, uint8_t *data, size_t len) {
+    return YI2C::write_read(bus_address, &reg, 1, data, len);
+}
+}; // namespace YAccel
@@ -1,97 +1,460 @@
 #include "yaudio.h"
+#include "ydsp.h"
+#include "ynotes.h"
 
 #include <Arduino.h>
 #include <AudioTools/AudioCodecs/CodecMP3Helix.h>
 #include <AudioTools/AudioCodecs/CodecWAV.h>
 #include <FS.h>
 #include <SD.h>
+#include <atomic>
+#include <unistd.h>
+#include <vector>
 
 namespace YAudio {
 
 ///////////////////////////////// Configuration Constants //////////////////////
 
-static const int MAX_NOTES_IN_BUFFER = 4000;
+// Must be a power of two so the queue indices can wrap around
+static const uint32_t MAX_NOTES_IN_BUFFER = 1024;
 
-// This is the sequence of notes to play
-static std::string notes;
+// Size of each wavetable. Must be a power of two, as the top bits of the phase index the table.
+static const int WAVETABLE_BITS = 8;
+static const int WAVETABLE_SIZE = 1 << WAVETABLE_BITS;
 
-// Notes state
-static int beats_per_minute;
-static int octave;
-static int volume_notes;
+// Number of samples mixed and sent to the speaker at a time
+static const int MIX_BLOCK_SAMPLES = 256;
+
+// How many levels of subdirectories are searched for sound files when building the file index
+static const int MAX_FILE_INDEX_DEPTH = 4;
+
+// Number of cached sounds that can play at the same time
+static const int NUM_EFFECT_CHANNELS = 2;
+static const int MAX_EFFECT_REQUESTS = 8;
+
+// Sound files are read ahead into a ring buffer by a separate task. Reads are a multiple of the
+// SD sector size and stay aligned to it, and the buffer size is a multiple of the read size.
+static const size_t SD_READ_SIZE = 8 * 1024;
+static const size_t DEFAULT_STREAM_BUFFER_SIZE = 64 * 1024; // With PSRAM
+static const size_t FALLBACK_STREAM_BUFFER_SIZE = 16 * 1024; // Without PSRAM
+
+// Maximum number of bytes handed from the ring buffer to the decoder at a time, and the number of
+// decoded samples that can be held for the mixer. One chunk decodes to at most two MP3 frames.
+static const size_t FILE_CHUNK_SIZE = 512;
+static const size_t FILE_FIFO_SAMPLES = 8192;
+
+// Sounds can be decoded ahead of time and kept in memory. When the cache is full, the least
+// recently played sounds are dropped to make room.
+static const int MAX_CACHED_SOUNDS = 16;
+static const size_t SOUND_CACHE_SIZE = 1024 * 1024;        // With PSRAM
+static const size_t FALLBACK_SOUND_CACHE_SIZE = 64 * 1024; // Without PSRAM
+
+// Recordings are written to the SD card in large blocks by a separate task, so a slow write
+// doesn't hold up reading the mic. The blocks are a multiple of the SD sector size and the WAV
+// header is part of the first one, so every write stays aligned to the sectors. The file is grown
+// ahead of the writes in large steps, so the FAT is only updated once per step instead of on
+// every write.
+static const size_t RECORD_BLOCK_SIZE = 16 * 1024;
+static const int NUM_RECORD_BLOCKS = 2;
+static const size_t RECORD_PREALLOCATE_SIZE = 1024 * 1024;
+
+// Number of samples read from the mic at a time. This is also the size of the frames passed to the
+// mic callback.
+static const size_t CAPTURE_SAMPLES = 256;
+
+// IMA-ADPCM compresses each 16-bit sample down to 4 bits. Samples are encoded in blocks, each
+// starting with the first sample and the step size so it can be decoded on its own.
+static const size_t ADPCM_BLOCK_SIZE = 512;
+static const size_t ADPCM_SAMPLES_PER_BLOCK = (ADPCM_BLOCK_SIZE - 4) * 2 + 1;
+
+// The WAV header is padded out to a whole ADPCM block, so the ADPCM blocks line up with the
+// recording blocks and dropping a recording block doesn't split an ADPCM block
+static const size_t MAX_WAV_HEADER_SIZE = ADPCM_BLOCK_SIZE;
+
+// Peak amplitude of the tones at full volume
+static const int16_t TONE_AMPLITUDE = 16000;
+
+// Length of the fade when the notes start and stop, to avoid pops
+static const int FADE_SAMPLES = 64;
+
+// Notes state, used when compiling new notes
+static YNotes::note_state notes_state;
 
 typedef struct {
-    unsigned int frequency;
-    unsigned int duration;
-} note_t;
+    uint32_t phase;
+    uint32_t phase_step;
+} voice_t;
 
-// Note playing task
+typedef enum { FORMAT_UNKNOWN, FORMAT_MP3, FORMAT_WAV } sound_format_t;
+
+typedef enum { FILE_IDLE, FILE_REQUESTED, FILE_ACTIVE } file_state_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t path_offset; // Into file_index_paths
+    sound_format_t format;
+} file_entry_t;
+
+typedef struct {
+    int id; // 0 for an empty slot
+    int16_t *pcm;
+    size_t num_samples;
+    uint32_t last_used;
+    std::atomic<int> users; // Effect channels playing the sound, or waiting to
+} cached_sound_t;
+
+typedef struct {
+    cached_sound_t *sound; // NULL when the channel is free
+    size_t position;
+    uint32_t started;
+} effect_channel_t;
+
+typedef struct {
+    cached_sound_t *sound;
+    uint32_t generation;
+} effect_request_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    bool last; // The recording is done once this block is written
+} record_block_t;
+
+typedef enum { RECORD_START, RECORD_STOP } record_command_t;
+
+// Converts decoded audio to the speaker format as it is written. The channels are averaged down
+// to mono and the sample rate is converted with linear interpolation.
+class SpeakerFormatWriter : public AudioOutput {
+  public:
+    void start() {
+        frame_bytes = 0;
+        phase = 0;
+        previous = 0;
+    }
+
+    void setAudioInfo(AudioInfo info) override;
+    size_t write(const uint8_t *data, size_t len) override;
+
+  protected:
+    virtual void emit(const int16_t *samples, size_t num_samples) = 0;
+
+  private:
+    static const int MAX_CHANNELS = 8;
+    int channels = 1;
+    uint32_t step = 0x10000; // Input samples per output sample (16.16 fixed point)
+    int16_t frame[MAX_CHANNELS];
+    size_t frame_bytes = 0;
+    uint32_t phase = 0;
+    int16_t previous = 0;
+};
+
+// Collects decoded audio for the sound file mixer channel
+class FileChannelWriter : public SpeakerFormatWriter {
+  protected:
+    void emit(const int16_t *samples, size_t num_samples) override;
+};
+
+// Collects decoded audio in memory, for loading sounds into the cache
+class CacheWriter : public SpeakerFormatWriter {
+  public:
+    void reset() {
+        start();
+        buffer = NULL;
+        capacity = 0;
+        length = 0;
+        failed = false;
+    }
+
+    int16_t *buffer = NULL;
+    size_t capacity = 0;
+    size_t length = 0;
+    bool failed = false;
+
+  protected:
+    void emit(const int16_t *samples, size_t num_samples) override;
+};
+
+// This is the queue of compiled notes to play. add_notes is the only writer of the tail and the
+// speaker task is the only writer of the head, so neither side ever waits on the other. The
+// indices count up forever and are wrapped when used to index the queue. To stop the notes,
+// stop_speaker sets the flush index and the speaker task skips the head forward to it.
+static YNotes::note note_queue[MAX_NOTES_IN_BUFFER];
+static std::atomic<uint32_t> note_queue_head(0);
+static std::atomic<uint32_t> note_queue_tail(0);
+static std::atomic<uint32_t> note_queue_flush(0);
+
+// Speaker task, which mixes all of the channels together. It sets a channel's done bit every time
+// the channel finishes playing, and starting a sound on the channel clears it.
 static TaskHandle_t play_speaker_task_handle;
-static SemaphoreHandle_t notes_mutex;
+static EventGroupHandle_t speaker_events;
 
-// General stream variables
-static StreamCopy copier;
+// Set once setup_speaker has created the tasks and queues the public functions use. With async
+// setup, the rest of the program can start running before then.
+static std::atomic<bool> speaker_ready(false);
 
-// Variables for speaker
+// Variables for speaker. Everything is mixed at the same sample rate, so the I2S configuration
+// never changes.
+static AudioInfo speakerInfo(44100, 1, 16);
+static I2SConfig speakerConfig;
 static I2SStream speakerOut;
-static PoppingSoundRemover<int16_t> poppingRemover(1, true, true);
-
-// Variables for tone generation
-static AudioInfo sineInfo(16000, 1, 16);
-static SineWaveGenerator<int16_t> sineWave(16000);
-static GeneratedSoundStream<int16_t> toneStream(sineWave);
+static int32_t channel_gain[NUM_AUDIO_CHANNELS] = {YDSP::Q15_ONE, YDSP::Q15_ONE, YDSP::Q15_ONE};
+
+// Variables for tone generation. Each voice steps a 32-bit phase through a wavetable, which
+// avoids any floating point math per sample.
+static int16_t wavetables[YNotes::NUM_WAVEFORMS][WAVETABLE_SIZE];
+static voice_t voices[YNotes::MAX_VOICES];
+static int active_voices = 0;
+static int32_t tone_gain = 0;
+static const int16_t *tone_wavetable = wavetables[YNotes::WAVE_SINE];
+static uint32_t tone_samples_left = 0;
+static uint32_t tone_flush = 0;
 static bool playing_tones = false;
-
-// Variables for audio file decoding
+static bool notes_channel_active = false;
+
+// Variables for audio file decoding. The decoders are fed by the speaker task, which takes the
+// decoded samples from the FIFO as it mixes. play_sound_file requests a file and the speaker task
+// takes it over, unless stop_speaker cancels the request first. Stopping bumps the generation.
+static FileChannelWriter file_writer;
+static MP3DecoderHelix *file_mp3 = new MP3DecoderHelix();
+static WAVDecoder *file_wav = new WAVDecoder();
+static EncodedAudioStream mp3_decoder(&file_writer, file_mp3);
+static EncodedAudioStream wav_decoder(&file_writer, file_wav);
+static EncodedAudioStream *file_decoder = NULL;
+static int16_t file_fifo[FILE_FIFO_SAMPLES];
+static size_t file_fifo_start = 0;
+static size_t file_fifo_count = 0;
+static bool file_decoder_ended = false;
+static bool file_starved = false;
+static std::atomic<file_state_t> file_state(FILE_IDLE);
+static std::atomic<uint32_t> file_generation(0);
+static uint32_t file_request_generation = 0;
+
+// Variables for cached sounds
+static cached_sound_t sound_cache[MAX_CACHED_SOUNDS];
+static size_t sound_cache_size = 0;
+static int next_cached_sound_id = 1;
+static uint32_t cache_use_counter = 0;
+static CacheWriter cache_writer;
+static MP3DecoderHelix *cache_mp3 = new MP3DecoderHelix();
+static WAVDecoder *cache_wav = new WAVDecoder();
+static EncodedAudioStream cache_mp3_decoder(&cache_writer, cache_mp3);
+static EncodedAudioStream cache_wav_decoder(&cache_writer, cache_wav);
+
+// Variables for the sound effect channels. play_cached_sound queues requests for the speaker
+// task, which owns the channels. stop_speaker bumps the generation to drop them all.
+static effect_channel_t effect_channels[NUM_EFFECT_CHANNELS];
+static QueueHandle_t effect_requests;
+static std::atomic<uint32_t> effects_generation(0);
+static std::atomic<int> effects_pending(0);
+static uint32_t effects_generation_playing = 0;
+static uint32_t effects_started = 0;
+
+// The file system sound files and recordings are on, and where it is mounted, for file
+// operations it doesn't provide
+static fs::FS *file_system = &SD;
+static const char *file_system_mount_point = "/sd";
+
+// Sound files found when the index was built, so playing one only has to open it. The table is
+// open addressed, with a power of two number of slots, each holding an index into file_index or
+// -1 if empty. It isn't changed once file_index_ready is set, so it can be read without a lock.
+// Files that aren't in the index, like new recordings, are found by opening them by name.
+static std::vector<file_entry_t> file_index;
+static std::vector<int32_t> file_index_slots;
+static std::vector<char> file_index_paths;
+static std::atomic<bool> file_index_ready(false);
+
+// Read-ahead buffer for sound files. The reader task is the only writer of the tail and the
+// speaker task is the only writer of the head. Like the note queue, the indices count up forever
+// and are wrapped when used to index the buffer. The reader gives sd_reader_done once it is done
+// with a file and has closed it.
 static File sound_file;
-static VolumeStream speakerVolume(speakerOut);
-static EncodedAudioStream wav_decoder(&speakerVolume, new WAVDecoder());
-static EncodedAudioStream mp3_decoder(&speakerVolume, new MP3DecoderHelix());
-static bool playing_file = false;
-
-// Variables for microphone
-static File speaker_recording_file;
+static TaskHandle_t sd_reader_task_handle;
+static SemaphoreHandle_t sd_reader_done;
+static uint8_t *stream_buffer = NULL;
+static size_t stream_buffer_size = 0;
+static std::atomic<uint32_t> stream_head(0);
+static std::atomic<uint32_t> stream_tail(0);
+static bool stream_start = false;
+static bool streaming_file = false;
+static bool stream_eof = false;
+static size_t stream_min_fill_level = 0;
+static uint32_t stream_underruns = 0;
+
+// Variables for microphone. The capture task is the only reader of the mic, and hands each frame
+// to the callback and the recording.
 static AudioInfo micInfo(44100, 1, 16);
+static I2SConfig micConfig;
 static I2SStream micIn;
-static VolumeStream micVolume(micIn);
-
-// Variables for recording
-static EncodedAudioStream wav_encoder(&speaker_recording_file, new WAVEncoder());
+static int32_t mic_gain = YDSP::Q8_ONE;
+static YDSP::dc_filter_state mic_dc_filter = {0, 0};
+static TaskHandle_t mic_capture_task_handle;
+static std::atomic<bool> mic_ready(false);
+static mic_frame_callback mic_callback = NULL;
+static void *mic_callback_arg = NULL;
+static portMUX_TYPE mic_callback_lock = portMUX_INITIALIZER_UNLOCKED;
+alignas(16) static int16_t capture_buffer[CAPTURE_SAMPLES];
+
+// Variables for recording. Recordings are started and stopped by sending commands to the capture
+// task, which fills blocks from the mic and queues them for the writer task. The writer queues
+// them back once they are on the SD card. If the writer falls behind and there are no free
+// blocks, the newest audio is dropped and counted as an overrun, and left out of
+// recording_num_samples. The writer gives recorder_idle once it has finished the file.
+static File speaker_recording_file;
+static std::string recording_path;
+static AudioInfo recordingInfo(44100, 1, 16);
+static recording_codec recordingCodec = CODEC_PCM;
+static uint32_t recording_num_samples = 0;
+static bool capture_recording = false;
+static record_block_t record_block;
+static size_t record_block_start = 0;
+static uint8_t *record_blocks = NULL;
+static QueueHandle_t record_free_blocks;
+static QueueHandle_t record_full_blocks;
+static size_t recording_file_size = 0;
+static size_t recording_allocated_size = 0;
+static uint32_t recording_overruns = 0;
 static bool recording_audio = false;
-static bool done_recording_audio = true;
+static QueueHandle_t record_commands;
+static SemaphoreHandle_t recorder_idle;
+
+// Variables for the IMA-ADPCM encoder
+static const int16_t adpcm_step_table[89] = {
+    7,     8,     9,     10,    11,    12,    13,    14,    16,    17,    19,    21,    23,
+    25,    28,    31,    34,    37,    41,    45,    50,    55,    60,    66,    73,    80,
+    88,    97,    107,   118,   130,   143,   157,   173,   190,   209,   230,   253,   279,
+    307,   337,   371,   408,   449,   494,   544,   598,   658,   724,   796,   876,   963,
+    1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,  2272,  2499,  2749,  3024,  3327,
+    3660,  4026,  4428,  4871,  5358,  5894,  6484,  7132,  7845,  8630,  9493,  10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+static const int8_t adpcm_index_table[16] = {-1, -1, -1, -1, 2, 4, 6, 8,
+                                             -1, -1, -1, -1, 2, 4, 6, 8};
+static int16_t adpcm_samples[ADPCM_SAMPLES_PER_BLOCK];
+static size_t adpcm_num_samples = 0;
+static int adpcm_index = 0;
+
+// Power save. The speaker and capture tasks are the only users of their I2S devices, so each one
+// stops its own device once it has been idle for power_save_ms, and starts it again when it next
+// has something to do. Stopping the I2S clocks also puts the amplifier into shutdown.
+static std::atomic<uint32_t> power_save_ms(0);
+static std::atomic<bool> speaker_running(false);
+static std::atomic<bool> mic_running(false);
+static power_stats speaker_power_stats = {};
+static portMUX_TYPE power_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#if YAUDIO_STATS
+// Statistics. Each is updated by one task, under the lock so get_stats sees a consistent copy.
+// Start times are stored when a sound is started, and taken by the speaker task when it mixes its
+// first samples. 0 means no sound is waiting to start.
+static audio_stats pipeline_stats = {};
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static std::atomic<uint32_t> start_times_us[NUM_AUDIO_CHANNELS];
+static uint32_t speaker_dma_us = 0;
+
+// Times within a task use the cycle counter, which is separate for each core
+typedef struct {
+    uint32_t cycles;
+    BaseType_t core;
+} stats_timer_t;
+#endif
 
 //////////////////////////// Private Function Prototypes ///////////////////////
 // Local private functions
+#if YAUDIO_STATS
+static stats_timer_t start_stats_timer();
+static void stop_stats_timer(const stats_timer_t &timer, timing_stats &timing);
+static void record_time(timing_stats &timing, uint32_t us);
+static void record_start(audio_channel channel);
+static void record_first_samples(audio_channel channel);
+static uint32_t dma_duration_us(const I2SConfig &config);
+#endif
+static bool create_task(TaskFunction_t task, const char *name, const task_config &config,
+                        TaskHandle_t *handle);
 static void play_speaker_task(void *params);
-static void recording_audio_task(void *params);
-static note_t parse_next_note();
-static void set_note_defaults();
+static void mic_capture_task(void *params);
+static bool wait_for_work(std::atomic<bool> &running);
+static void restart_speaker(uint32_t woke_at, const int16_t *mix, size_t len);
+static void begin_recording();
+static void end_recording();
+static void set_mic_sample_rate(const AudioInfo &info);
+static void record_writer_task(void *params);
+static size_t fill_wav_header(uint8_t *header, uint32_t data_size);
+static void encode_samples(const int16_t *samples, size_t num_samples);
+static void record_bytes(const uint8_t *data, size_t len);
+static void next_record_block();
+static void encode_adpcm_block(const int16_t *samples, uint8_t *block);
+static bool pop_note(YNotes::note &note);
+static bool notes_pending();
+static void build_wavetables();
+static void start_tone(const YNotes::note &note);
+static void render_tones(int16_t *buffer, int num_samples);
+static bool mix_block(int16_t *mix);
+static int mix_notes(int16_t *buffer, int num_samples);
+static int mix_file(int16_t *buffer, int num_samples);
+static int mix_effect(effect_channel_t &channel, int16_t *buffer, int num_samples);
+static void start_effects();
+static void release_effect(effect_channel_t &channel);
+static void stop_file();
+static void end_file();
+static bool channel_playing(audio_channel channel);
+static void set_channel_done(audio_channel channel);
+static void clear_channel_done(audio_channel channel);
+static sound_format_t open_sound_file(const char *filename, File &file);
+static sound_format_t read_sound_format(File &file);
+static void index_directory(File &directory, int depth);
+static bool has_sound_extension(const char *path);
+static uint32_t hash_path(const char *path);
+static const file_entry_t *find_indexed_file(const char *filename);
+static bool make_room_in_cache(size_t num_samples);
+static void sd_reader_task(void *params);
 
 ////////////////////////////// Public Functions ///////////////////////////////
-bool setup_speaker(int ws_pin, int bck_pin, int data_pin, int i2s_port) {
-    set_note_defaults();
+bool setup_speaker(int ws_pin, int bck_pin, int data_pin, int i2s_port,
+                   const audio_config &tasks) {
+    build_wavetables();
 
     Serial.println("starting I2S...");
     auto config = speakerOut.defaultConfig(TX_MODE);
-    config.copyFrom(sineInfo);
+    config.copyFrom(speakerInfo);
     config.pin_ws = ws_pin;
     config.pin_bck = bck_pin;
     config.pin_data = data_pin;
     config.port_no = i2s_port;
 
+    speakerConfig = config;
     speakerOut.begin(config);
-    speakerVolume.begin(config);
-
-    // Create the mutex for notes string
-    notes_mutex = xSemaphoreCreateMutex();
+    speaker_running = true;
+#if YAUDIO_STATS
+    speaker_dma_us = dma_duration_us(config);
+#endif
+
+    // Have the decoders report the format of each file, so it can be converted for the mixer
+    file_mp3->addNotifyAudioChange(file_writer);
+    file_wav->addNotifyAudioChange(file_writer);
+    cache_mp3->addNotifyAudioChange(cache_writer);
+    cache_wav->addNotifyAudioChange(cache_writer);
+
+    if (!set_stream_buffer_size(psramFound() ? DEFAULT_STREAM_BUFFER_SIZE
+                                             : FALLBACK_STREAM_BUFFER_SIZE)) {
+        return false;
+    }
 
-    // Create task that will actually do the playing
-    xTaskCreate(play_speaker_task, "play_speaker_task", 4096, NULL, 1, &play_speaker_task_handle);
+    // Create task that will actually do the playing, and the one that reads sound files for it
+    speaker_events = xEventGroupCreate();
+    effect_requests = xQueueCreate(MAX_EFFECT_REQUESTS, sizeof(effect_request_t));
+    sd_reader_done = xSemaphoreCreateBinary();
+    xSemaphoreGive(sd_reader_done);
+    if (!create_task(play_speaker_task, "play_speaker_task", tasks.speaker_task,
+                     &play_speaker_task_handle) ||
+        !create_task(sd_reader_task, "sd_reader_task", tasks.sd_reader_task,
+                     &sd_reader_task_handle)) {
+        return false;
+    }
 
+    speaker_ready = true;
     return true;
 }
 
-bool setup_mic(int ws_pin, int data_pin, int i2s_port) {
+bool setup_mic(int ws_pin, int data_pin, int i2s_port, const audio_config &tasks) {
     auto config = micIn.defaultConfig(RX_MODE);
     config.copyFrom(micInfo);
     config.signal_type = PDM;
@@ -101,86 +464,352 @@ bool setup_mic(int ws_pin, int data_pin, int i2s_port) {
     config.pin_ws = ws_pin;
     config.pin_data = data_pin;
 
-    auto volumeConfig = micVolume.defaultConfig();
-    volumeConfig.copyFrom(micInfo);
-    volumeConfig.allow_boost = true;
-
+    micConfig = config;
     micIn.begin(config);
-    micVolume.begin(volumeConfig);
+    mic_running = true;
+
+    // Prefer PSRAM, so the blocks don't use up internal RAM
+    size_t size = NUM_RECORD_BLOCKS * RECORD_BLOCK_SIZE;
+    record_blocks = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!record_blocks) {
+        record_blocks = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    if (!record_blocks) {
+        Serial.printf("Error allocating %d byte recording buffer.\n", size);
+        return false;
+    }
+
+    record_free_blocks = xQueueCreate(NUM_RECORD_BLOCKS, sizeof(uint8_t *));
+    record_full_blocks = xQueueCreate(NUM_RECORD_BLOCKS, sizeof(record_block_t));
+    record_commands = xQueueCreate(2, sizeof(record_command_t));
+    recorder_idle = xSemaphoreCreateBinary();
+    xSemaphoreGive(recorder_idle);
+
+    // Create the task that reads the mic, and the one that writes recordings. Reading the mic can't
+    // wait on the SD card, so it runs at a higher priority than writing.
+    if (!create_task(mic_capture_task, "mic_capture_task", tasks.mic_capture_task,
+                     &mic_capture_task_handle) ||
+        !create_task(record_writer_task, "record_writer_task", tasks.record_writer_task, NULL)) {
+        return false;
+    }
 
+    mic_ready = true;
     return true;
 }
 
 bool start_recording(const std::string &filename) {
-    if (recording_audio) {
+    return start_recording(filename, AudioInfo(44100, 1, 16), CODEC_PCM);
+}
+
+bool start_recording(const std::string &filename, const AudioInfo &info, recording_codec codec) {
+    if (!mic_ready) {
+        Serial.println("Error recording: microphone not set up.");
+        return false;
+    }
+
+    // The recorder stays busy until the last recording's file is finished
+    if (recording_audio || xSemaphoreTake(recorder_idle, 0) != pdTRUE) {
         Serial.println("Already recording audio");
         return false;
     }
 
-    speaker_recording_file = SD.open(filename.c_str(), FILE_WRITE);
+    if (info.channels != 1 || (codec == CODEC_PCM && info.bits_per_sample != 8 &&
+                               info.bits_per_sample != 16)) {
+        Serial.println("Error recording: only mono 8 or 16 bit recordings are supported.");
+        xSemaphoreGive(recorder_idle);
+        return false;
+    }
+
+    speaker_recording_file = file_system->open(filename.c_str(), FILE_WRITE);
     if (!speaker_recording_file) {
         Serial.println("Error opening/creating file for recording.");
+        xSemaphoreGive(recorder_idle);
         return false;
     }
 
     // Set up initial state
+    recording_path = filename;
+    recordingInfo = info;
+    recordingCodec = codec;
+    recording_num_samples = 0;
+    recording_file_size = 0;
+    recording_allocated_size = 0;
+    recording_overruns = 0;
     recording_audio = true;
-    done_recording_audio = false;
 
-    // Create the task to actually do the recording
-    xTaskCreate(recording_audio_task, "recording_audio_task", 4096, NULL, 1, NULL);
+    // The recording task starts out with the first block, so the rest are free
+    xQueueReset(record_free_blocks);
+    xQueueReset(record_full_blocks);
+    for (int i = 1; i < NUM_RECORD_BLOCKS; i++) {
+        uint8_t *block = record_blocks + i * RECORD_BLOCK_SIZE;
+        xQueueSend(record_free_blocks, &block, 0);
+    }
+
+    // Have the capture task start on it, as of the next frame
+    record_command_t command = RECORD_START;
+    xQueueSend(record_commands, &command, portMAX_DELAY);
+    xTaskNotifyGive(mic_capture_task_handle);
 
     return true;
 }
 
-void recording_audio_task(void *params) {
-    wav_encoder.begin(micInfo);
-    copier.begin(wav_encoder, micVolume);
+void mic_capture_task(void *params) {
+#if YAUDIO_STATS
+    bool reading = false;
+    uint32_t last_read_end = 0;
+#endif
 
-    while (recording_audio) {
-        copier.copy();
+    while (1) {
+        portENTER_CRITICAL(&mic_callback_lock);
+        mic_frame_callback callback = mic_callback;
+        void *callback_arg = mic_callback_arg;
+        portEXIT_CRITICAL(&mic_callback_lock);
+
+        record_command_t command;
+        while (xQueueReceive(record_commands, &command, 0) == pdTRUE) {
+            if (command == RECORD_START && !capture_recording) {
+                begin_recording();
+            } else if (command == RECORD_STOP && capture_recording) {
+                end_recording();
+            }
+        }
+
+        // Block waiting for something to read the mic for
+        if (!callback && !capture_recording) {
+#if YAUDIO_STATS
+            reading = false;
+#endif
+            if (!wait_for_work(mic_running)) {
+                micIn.end();
+                mic_running = false;
+            }
+            continue;
+        }
+
+        if (!mic_running) {
+            micIn.begin(micConfig);
+            mic_running = true;
+        }
+
+#if YAUDIO_STATS
+        // If the last read was longer ago than the DMA buffers last, samples were dropped
+        uint32_t read_start = micros();
+        if (reading && read_start - last_read_end > dma_duration_us(micConfig)) {
+            portENTER_CRITICAL(&stats_lock);
+            pipeline_stats.mic_overruns++;
+            portEXIT_CRITICAL(&stats_lock);
+        }
+#endif
+
+        // The mic has a DC offset, which is removed along with applying the gain. Both are done in
+        // place, so the callback and the recording get the same buffer without another copy.
+        size_t len = micIn.readBytes((uint8_t *)capture_buffer, sizeof(capture_buffer));
+        size_t num_samples = len / sizeof(int16_t);
+#if YAUDIO_STATS
+        last_read_end = micros();
+        reading = true;
+        stats_timer_t frame_timer = start_stats_timer();
+#endif
+        YDSP::remove_dc(capture_buffer, num_samples, mic_dc_filter);
+        YDSP::apply_gain(capture_buffer, num_samples, mic_gain);
+        if (callback) {
+            callback(capture_buffer, num_samples, callback_arg);
+        }
+        if (capture_recording) {
+            recording_num_samples += num_samples;
+            encode_samples(capture_buffer, num_samples);
+        }
+#if YAUDIO_STATS
+        stop_stats_timer(frame_timer, pipeline_stats.mic_frame_time);
+#endif
+    }
+}
+
+void begin_recording() {
+    // The mic filters and decimates down to the sample rate itself, so change its sample rate
+    // rather than throwing samples away
+    set_mic_sample_rate(recordingInfo);
+
+    // Leave room for the header at the start of the first block. It is filled in once the length of
+    // the recording is known.
+    record_block.data = record_blocks;
+    record_block.len = fill_wav_header(record_block.data, 0);
+    record_block.last = false;
+    record_block_start = record_block.len;
+    adpcm_num_samples = 0;
+    adpcm_index = 0;
+    capture_recording = true;
+}
+
+void end_recording() {
+    // Finish the last ADPCM block, padded out with silence
+    memset(capture_buffer, 0, sizeof(capture_buffer));
+    while (recordingCodec == CODEC_IMA_ADPCM && adpcm_num_samples > 0) {
+        encode_samples(capture_buffer,
+                       min(CAPTURE_SAMPLES, ADPCM_SAMPLES_PER_BLOCK - adpcm_num_samples));
+    }
+
+    // Hand over whatever is left, which tells the writer to finish the file
+    record_block.last = true;
+    xQueueSend(record_full_blocks, &record_block, portMAX_DELAY);
+    capture_recording = false;
+
+    // Go back to the rate the mic callback expects. This also keeps the mic from coming back at the
+    // recording's rate after it has been powered down.
+    set_mic_sample_rate(micInfo);
+}
+
+// Changes the mic to the sample rate of info, restarting it if it is running. If it is powered
+// down, it starts at the new rate when it is next needed.
+void set_mic_sample_rate(const AudioInfo &info) {
+    if (micConfig.sample_rate == info.sample_rate) {
+        return;
+    }
+
+    micConfig.sample_rate = info.sample_rate;
+    if (mic_running) {
+        micIn.end();
+        micIn.begin(micConfig);
     }
+}
+
+void record_writer_task(void *params) {
+    while (1) {
+        // Block waiting for a recording to write
+        record_block_t block;
+        xQueueReceive(record_full_blocks, &block, portMAX_DELAY);
+
+        // Grow the file ahead of the writes, by writing a byte past the end of the new size
+        if (recording_file_size + block.len > recording_allocated_size) {
+            recording_allocated_size += RECORD_PREALLOCATE_SIZE;
+            speaker_recording_file.seek(recording_allocated_size - 1);
+            speaker_recording_file.write((uint8_t)0);
+            speaker_recording_file.seek(recording_file_size);
+        }
 
-    speaker_recording_file.flush();
-    speaker_recording_file.close();
-    wav_encoder.end();
+        if (speaker_recording_file.write(block.data, block.len) != block.len) {
+            Serial.println("Error writing recording to SD card.");
+        }
+        recording_file_size += block.len;
 
-    // Indicate to the main task that we are done
-    done_recording_audio = true;
+        if (!block.last) {
+            xQueueSend(record_free_blocks, &block.data, portMAX_DELAY);
+            continue;
+        }
 
-    // This task is done so delete itself
-    vTaskDelete(NULL);
+        // Now that the length is known, fill in the header, and cut off the space that was grown
+        // ahead but never used
+        uint8_t header[MAX_WAV_HEADER_SIZE];
+        size_t header_size = fill_wav_header(header, 0);
+        fill_wav_header(header, recording_file_size - header_size);
+        speaker_recording_file.seek(0);
+        speaker_recording_file.write(header, header_size);
+        speaker_recording_file.close();
+
+        std::string path = file_system_mount_point + recording_path;
+        if (truncate(path.c_str(), recording_file_size) != 0) {
+            Serial.println("Error trimming recording file.");
+        }
+
+        // Indicate to the main task that we are done
+        xSemaphoreGive(recorder_idle);
+    }
 }
 
 void stop_recording() {
-    // Notify the other task it should be done
+    if (!recording_audio) {
+        return;
+    }
+
+    // Notify the capture task it should be done
     recording_audio = false;
+    record_command_t command = RECORD_STOP;
+    xQueueSend(record_commands, &command, portMAX_DELAY);
+    xTaskNotifyGive(mic_capture_task_handle);
 
-    // Wait for other task to finish
-    while (!done_recording_audio) {
-        delay(10);
-    }
+    // Wait for the writer to finish the file
+    xSemaphoreTake(recorder_idle, portMAX_DELAY);
+    xSemaphoreGive(recorder_idle);
 }
 
 bool is_recording() { return recording_audio; }
 
-void set_recording_gain(uint8_t new_gain) { micVolume.setVolume(new_gain); }
+uint32_t get_recording_overruns() { return recording_overruns; }
+
+void set_recording_gain(uint8_t new_gain) { mic_gain = new_gain * YDSP::Q8_ONE; }
+
+void set_power_save(uint32_t idle_ms) {
+    power_save_ms = idle_ms;
+
+    // Wake the tasks, so they start timing how long they have been idle
+    if (speaker_ready) {
+        xTaskNotifyGive(play_speaker_task_handle);
+    }
+    if (mic_ready) {
+        xTaskNotifyGive(mic_capture_task_handle);
+    }
+}
+
+bool is_powered_down() { return !speaker_running && !mic_running; }
+
+power_stats get_power_stats() {
+    portENTER_CRITICAL(&power_stats_lock);
+    power_stats stats = speaker_power_stats;
+    portEXIT_CRITICAL(&power_stats_lock);
+    return stats;
+}
 
 I2SStream &get_speaker_stream() { return speakerOut; }
 
 I2SStream &get_mic_stream() { return micIn; }
 
+void set_mic_callback(mic_frame_callback callback, void *arg) {
+    portENTER_CRITICAL(&mic_callback_lock);
+    mic_callback = callback;
+    mic_callback_arg = arg;
+    portEXIT_CRITICAL(&mic_callback_lock);
+
+    if (mic_ready) {
+        xTaskNotifyGive(mic_capture_task_handle);
+    }
+}
+
 bool add_notes(const std::string &new_notes) {
-    if ((notes.length() + new_notes.length()) > MAX_NOTES_IN_BUFFER) {
-        Serial.printf("Error adding notes: too many notes in buffer (%d + %d > %d).\n",
-                      new_notes.length(), notes.length(), MAX_NOTES_IN_BUFFER);
+    if (!speaker_ready) {
+        Serial.println("Error adding notes: speaker not set up.");
         return false;
     }
 
-    // Append the new notes to the existing notes
-    xSemaphoreTake(notes_mutex, portMAX_DELAY);
-    notes += new_notes;
-    xSemaphoreGive(notes_mutex);
+    // If the notes don't fit, leave the note state as if they were never added
+    YNotes::note_state saved_state = notes_state;
+
+    // Compile the notes straight into the free part of the queue, then publish them all at once
+    YNotes::note_queue queue = {note_queue, MAX_NOTES_IN_BUFFER,
+                                note_queue_head.load(std::memory_order_acquire),
+                                note_queue_tail.load(std::memory_order_relaxed)};
+    const char *error_at = NULL;
+#if YAUDIO_STATS
+    stats_timer_t compile_timer = start_stats_timer();
+#endif
+    YNotes::compile_result result = YNotes::compile(new_notes.c_str(), notes_state,
+                                                    speakerInfo.sample_rate, queue, &error_at);
+#if YAUDIO_STATS
+    stop_stats_timer(compile_timer, pipeline_stats.compile_time);
+#endif
+    if (result == YNotes::COMPILE_QUEUE_FULL) {
+        Serial.printf("Error adding notes: too many notes in buffer (max %d).\n",
+                      MAX_NOTES_IN_BUFFER);
+        notes_state = saved_state;
+        return false;
+    }
+    if (result == YNotes::COMPILE_SYNTAX_ERROR) {
+        Serial.printf("Syntax error in notes: %s\n", error_at);
+    }
+    clear_channel_done(CHANNEL_NOTES);
+    note_queue_tail.store(queue.tail, std::memory_order_release);
+#if YAUDIO_STATS
+    record_start(CHANNEL_NOTES);
+#endif
 
     // Signal we need to play the notes
     playing_tones = true;
@@ -192,265 +821,1216 @@ bool add_notes(const std::string &new_notes) {
 void stop_speaker() {
     // Update flags
     playing_tones = false;
-    playing_file = false;
+    stop_file();
 
-    // Clear out all pending notes
-    xSemaphoreTake(notes_mutex, portMAX_DELAY);
-    notes.clear();
-    xSemaphoreGive(notes_mutex);
+    // Clear out all pending notes and sound effects
+    note_queue_flush.store(note_queue_tail.load(std::memory_order_relaxed),
+                           std::memory_order_release);
+    effects_generation++;
+}
 
-    copier.end();
+bool is_playing() {
+    for (int channel = 0; channel < NUM_AUDIO_CHANNELS; channel++) {
+        if (channel_playing((audio_channel)channel)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool is_channel_playing(audio_channel channel) { return channel_playing(channel); }
+
+void wait_for_channel(audio_channel channel) {
+    // The done bit is only cleared when a sound is started on the channel, so any number of tasks
+    // can wait for it. If it is still set from the sound before, check again every tick.
+    while (channel_playing(channel)) {
+        xEventGroupWaitBits(speaker_events, BIT0 << channel, pdFALSE, pdFALSE, portMAX_DELAY);
+        if (channel_playing(channel)) {
+            vTaskDelay(1);
+        }
+    }
+}
+
+void wait_for_playback() {
+    for (int channel = 0; channel < NUM_AUDIO_CHANNELS; channel++) {
+        wait_for_channel((audio_channel)channel);
+    }
+}
+
+void set_file_system(fs::FS &fs, const char *mount_point) {
+    file_system = &fs;
+    file_system_mount_point = mount_point;
 }
 
-bool is_playing() { return playing_tones || playing_file; }
+// Scans the file system for sound files, and remembers where each one is and its format
+bool build_file_index(const char *directory) {
+    if (file_index_ready) {
+        return true;
+    }
+
+    File root = file_system->open(directory);
+    if (!root || !root.isDirectory()) {
+        Serial.printf("Error indexing sound files: can't open %s\n", directory);
+        return false;
+    }
+    index_directory(root, 0);
+    root.close();
+
+    size_t num_slots = 1;
+    while (num_slots < 2 * file_index.size()) {
+        num_slots <<= 1;
+    }
+    file_index_slots.assign(num_slots, -1);
+    for (size_t i = 0; i < file_index.size(); i++) {
+        uint32_t slot = file_index[i].hash & (num_slots - 1);
+        while (file_index_slots[slot] >= 0) {
+            slot = (slot + 1) & (num_slots - 1);
+        }
+        file_index_slots[slot] = i;
+    }
+
+    file_index_ready = true;
+    Serial.printf("Indexed %u sound files\n", (unsigned)file_index.size());
+    return true;
+}
 
-bool play_sound_file(const std::string &filename) {
-    // Whether notes or wave is running, stop it
-    stop_speaker();
+bool play_sound_file(const std::string &filename) { return play_sound_file(filename.c_str()); }
 
-    sound_file = SD.open(filename.c_str());
-    if (!sound_file) {
-        Serial.printf("Error opening file: %s\n", filename.c_str());
+bool play_sound_file(const char *filename) {
+    if (!speaker_ready) {
+        Serial.println("Error playing sound file: speaker not set up.");
         return false;
     }
 
-    char start[4];
-    sound_file.readBytes(start, 4);
-    sound_file.seek(0);
+    // If another sound file is playing, stop it and wait for the speaker task to let go of the
+    // decoder, and for the reader to close the file
+    stop_file();
+    wait_for_channel(CHANNEL_SOUND_FILE);
+    xSemaphoreTake(sd_reader_done, portMAX_DELAY);
 
-    if (start[0] == 0xFF || start[0] == 0xFE || strncmp("ID3", (const char *)start, 3) == 0) {
+    switch (open_sound_file(filename, sound_file)) {
+    case FORMAT_MP3:
         LOGI("using MP3DecoderHelix");
         mp3_decoder.end();
         mp3_decoder.begin();
-        copier.begin(mp3_decoder, sound_file);
-    } else if (strncmp("RIFF", (const char *)start, 4) == 0) {
+        file_decoder = &mp3_decoder;
+        break;
+    case FORMAT_WAV:
         LOGI("using WAVDecoder");
         wav_decoder.end();
         wav_decoder.begin();
-        copier.begin(wav_decoder, sound_file);
-    } else {
-        LOGE("Unknown file type");
+        file_decoder = &wav_decoder;
+        break;
+    default:
+        xSemaphoreGive(sd_reader_done);
+        return false;
+    }
+
+    // The speaker task starts the reader when it picks up the file
+    stream_head = 0;
+    stream_tail = 0;
+    stream_eof = false;
+    stream_min_fill_level = stream_buffer_size;
+
+    file_request_generation = file_generation.load();
+#if YAUDIO_STATS
+    record_start(CHANNEL_SOUND_FILE);
+#endif
+    clear_channel_done(CHANNEL_SOUND_FILE);
+    file_state = FILE_REQUESTED;
+    xTaskNotifyGive(play_speaker_task_handle);
+
+    return true;
+}
+
+int cache_sound_file(const std::string &filename) {
+    if (!speaker_ready) {
+        Serial.println("Error caching sound file: speaker not set up.");
+        return -1;
+    }
+
+    File file;
+    EncodedAudioStream *decoder;
+    switch (open_sound_file(filename.c_str(), file)) {
+    case FORMAT_MP3:
+        decoder = &cache_mp3_decoder;
+        break;
+    case FORMAT_WAV:
+        decoder = &cache_wav_decoder;
+        break;
+    default:
+        return -1;
+    }
+
+    // Decode the whole file into memory, already converted for the mixer
+    cache_writer.reset();
+    decoder->begin();
+    uint8_t chunk[512];
+    size_t len;
+    while (!cache_writer.failed && (len = file.read(chunk, sizeof(chunk))) > 0) {
+        decoder->write(chunk, len);
+    }
+    decoder->end();
+    file.close();
+
+    if (cache_writer.failed || !make_room_in_cache(cache_writer.length)) {
+        Serial.printf("Error caching %s: not enough memory.\n", filename.c_str());
+        heap_caps_free(cache_writer.buffer);
+        return -1;
+    }
+
+    // make_room_in_cache leaves at least one empty slot
+    cached_sound_t *sound = sound_cache;
+    while (sound->id) {
+        sound++;
+    }
+
+    // Give back the extra room used while decoding
+    int16_t *pcm = (int16_t *)heap_caps_realloc(cache_writer.buffer,
+                                                cache_writer.length * sizeof(int16_t),
+                                                MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    sound->pcm = pcm ? pcm : cache_writer.buffer;
+    sound->num_samples = cache_writer.length;
+    sound->last_used = cache_use_counter++;
+    sound->users = 0;
+    sound->id = next_cached_sound_id++;
+    sound_cache_size += sound->num_samples;
+
+    return sound->id;
+}
+
+bool play_cached_sound(int id) {
+    if (!speaker_ready) {
+        Serial.println("Error playing cached sound: speaker not set up.");
+        return false;
+    }
+
+    cached_sound_t *sound = NULL;
+    for (int i = 0; i < MAX_CACHED_SOUNDS; i++) {
+        if (sound_cache[i].id == id) {
+            sound = &sound_cache[i];
+            sound_cache[i].last_used = cache_use_counter++;
+            break;
+        }
+    }
+
+    if (!sound) {
+        Serial.printf("Error playing cached sound %d: not in the cache.\n", id);
+        return false;
+    }
+
+    // The sound can't be removed from the cache until the speaker task is done with it
+    clear_channel_done(CHANNEL_SOUND_EFFECTS);
+    sound->users++;
+    effects_pending++;
+#if YAUDIO_STATS
+    record_start(CHANNEL_SOUND_EFFECTS);
+#endif
+    effect_request_t request = {sound, effects_generation.load()};
+    if (xQueueSend(effect_requests, &request, 0) != pdTRUE) {
+        sound->users--;
+        if (--effects_pending == 0) {
+            set_channel_done(CHANNEL_SOUND_EFFECTS);
+        }
+        Serial.println("Error playing cached sound: too many sounds at once.");
         return false;
     }
 
-    playing_file = true;
     xTaskNotifyGive(play_speaker_task_handle);
 
     return true;
 }
 
+void set_channel_volume(audio_channel channel, uint8_t volume) {
+    channel_gain[channel] = min(volume, (uint8_t)10) * YDSP::Q15_ONE / 10;
+}
+
+bool set_stream_buffer_size(size_t size) {
+    if (is_playing()) {
+        Serial.println("Error setting stream buffer size: audio is playing.");
+        return false;
+    }
+
+    // Round up to a whole number of reads, with room for at least two
+    size = max((size + SD_READ_SIZE - 1) / SD_READ_SIZE, (size_t)2) * SD_READ_SIZE;
+
+    // Prefer PSRAM, so the buffer doesn't use up internal RAM
+    heap_caps_free(stream_buffer);
+    stream_buffer = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!stream_buffer) {
+        stream_buffer = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    if (!stream_buffer) {
+        Serial.printf("Error allocating %d byte stream buffer.\n", size);
+        stream_buffer_size = 0;
+        return false;
+    }
+
+    stream_buffer_size = size;
+    return true;
+}
+
+stream_buffer_stats get_stream_buffer_stats() {
+    stream_buffer_stats stats;
+    stats.buffer_size = stream_buffer_size;
+    stats.fill_level = stream_tail.load(std::memory_order_acquire) -
+                       stream_head.load(std::memory_order_acquire);
+    stats.min_fill_level = stream_min_fill_level;
+    stats.underruns = stream_underruns;
+    return stats;
+}
+
+#if YAUDIO_STATS
+audio_stats get_stats() {
+    portENTER_CRITICAL(&stats_lock);
+    audio_stats stats = pipeline_stats;
+    portEXIT_CRITICAL(&stats_lock);
+
+    stats.stream_underruns = stream_underruns;
+    stats.recording_overruns = recording_overruns;
+    return stats;
+}
+
+void reset_stats() {
+    portENTER_CRITICAL(&stats_lock);
+    pipeline_stats = {};
+    portEXIT_CRITICAL(&stats_lock);
+}
+#endif
+
 ////////////////////////////// Private Functions ///////////////////////////////
 
-void set_note_defaults() {
-    beats_per_minute = 120;
-    octave = 5;
-    volume_notes = 5;
+bool create_task(TaskFunction_t task, const char *name, const task_config &config,
+                 TaskHandle_t *handle) {
+    if (xTaskCreatePinnedToCore(task, name, config.stack_size, NULL, config.priority, handle,
+                                config.core) != pdPASS) {
+        Serial.printf("Error creating %s.\n", name);
+        return false;
+    }
+    return true;
 }
 
-note_t parse_next_note() {
-    static float note_freq;
-    static float duration_s;
+#if YAUDIO_STATS
+stats_timer_t start_stats_timer() {
+    stats_timer_t timer = {ESP.getCycleCount(), xPortGetCoreID()};
+    return timer;
+}
 
-    while (notes.length()) {
-        // If first character is white space, remove it and continue
-        if (isspace(notes[0])) {
-            notes.erase(0, 1);
-            continue;
+void stop_stats_timer(const stats_timer_t &timer, timing_stats &timing) {
+    uint32_t cycles = ESP.getCycleCount() - timer.cycles;
+
+    // Tasks without a core can move between them, and the counts then can't be compared
+    if (xPortGetCoreID() != timer.core) {
+        return;
+    }
+
+    portENTER_CRITICAL(&stats_lock);
+    record_time(timing, cycles / ESP.getCpuFreqMHz());
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+// Must be called with stats_lock held
+void record_time(timing_stats &timing, uint32_t us) {
+    int bucket = us ? 32 - __builtin_clz(us) : 0;
+    timing.histogram[min(bucket, STATS_HISTOGRAM_BUCKETS - 1)]++;
+    timing.count++;
+    timing.total_us += us;
+    timing.max_us = max(timing.max_us, us);
+}
+
+// The sounds are started from other tasks, possibly on the other core, so these use micros
+void record_start(audio_channel channel) {
+    uint32_t now = micros();
+    start_times_us[channel] = now ? now : 1;
+}
+
+void record_first_samples(audio_channel channel) {
+    uint32_t start = start_times_us[channel].exchange(0);
+    if (start) {
+        uint32_t latency = micros() - start;
+        portENTER_CRITICAL(&stats_lock);
+        record_time(pipeline_stats.start_latency[channel], latency);
+        portEXIT_CRITICAL(&stats_lock);
+    }
+}
+
+// How long the I2S DMA buffers hold, from the number of buffers and frames in each
+uint32_t dma_duration_us(const I2SConfig &config) {
+    return (uint64_t)config.buffer_count * config.buffer_size * 1000000 / config.sample_rate;
+}
+#endif
+
+bool pop_note(YNotes::note &note) {
+    uint32_t head = note_queue_head.load(std::memory_order_relaxed);
+
+    // Skip over any notes that were flushed by stop_speaker
+    uint32_t flush = note_queue_flush.load(std::memory_order_acquire);
+    if ((int32_t)(flush - head) > 0) {
+        head = flush;
+    }
+
+    if (head == note_queue_tail.load(std::memory_order_acquire)) {
+        note_queue_head.store(head, std::memory_order_release);
+        return false;
+    }
+
+    note = note_queue[head % MAX_NOTES_IN_BUFFER];
+    note_queue_head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+bool notes_pending() {
+    uint32_t tail = note_queue_tail.load(std::memory_order_acquire);
+    uint32_t head = note_queue_head.load(std::memory_order_acquire);
+    uint32_t flush = note_queue_flush.load(std::memory_order_acquire);
+    return head != tail && flush != tail;
+}
+
+void build_wavetables() {
+    for (int i = 0; i < WAVETABLE_SIZE; i++) {
+        float t = (float)i / WAVETABLE_SIZE; // Position in the cycle, from 0 to 1
+        wavetables[YNotes::WAVE_SINE][i] = round(TONE_AMPLITUDE * sin(2 * PI * t));
+        wavetables[YNotes::WAVE_SQUARE][i] = (t < 0.5) ? TONE_AMPLITUDE : -TONE_AMPLITUDE;
+        wavetables[YNotes::WAVE_TRIANGLE][i] =
+            round(TONE_AMPLITUDE * ((t < 0.5) ? (4 * t - 1) : (3 - 4 * t)));
+        wavetables[YNotes::WAVE_SAWTOOTH][i] = round(TONE_AMPLITUDE * (2 * t - 1));
+    }
+}
+
+void start_tone(const YNotes::note &note) {
+    int previous_voices = active_voices;
+    active_voices = 0;
+    for (int i = 0; i < YNotes::MAX_VOICES; i++) {
+        if (note.frequency[i]) {
+            // A voice that carries on from the last note keeps its phase and only changes speed,
+            // so the wave doesn't jump at the note boundary. A voice coming in after silence
+            // starts at the beginning of its cycle. The phase wraps around every 2^32, so this
+            // steps through one cycle per period.
+            if (active_voices >= previous_voices) {
+                voices[active_voices].phase = 0;
+            }
+            voices[active_voices].phase_step =
+                ((uint64_t)note.frequency[i] << 32) / speakerInfo.sample_rate;
+            active_voices++;
+        }
+    }
+
+    // Scale the volume down by the number of voices so chords don't clip (16.16 fixed point)
+    tone_gain = active_voices ? ((note.volume << 16) / (10 * active_voices)) : 0;
+    tone_wavetable = wavetables[note.wave];
+}
+
+void render_tones(int16_t *buffer, int num_samples) {
+    if (!active_voices) {
+        memset(buffer, 0, num_samples * sizeof(int16_t));
+        return;
+    }
+
+    for (int i = 0; i < num_samples; i++) {
+        int32_t sample = 0;
+        for (int v = 0; v < active_voices; v++) {
+            sample += tone_wavetable[voices[v].phase >> (32 - WAVETABLE_BITS)];
+            voices[v].phase += voices[v].phase_step;
+        }
+        buffer[i] = (sample * tone_gain) >> 16;
+    }
+}
+
+void SpeakerFormatWriter::setAudioInfo(AudioInfo info) {
+    AudioOutput::setAudioInfo(info);
+    channels = constrain(info.channels, 1, MAX_CHANNELS);
+    step = ((uint64_t)info.sample_rate << 16) / speakerInfo.sample_rate;
+}
+
+size_t SpeakerFormatWriter::write(const uint8_t *data, size_t len) {
+    const size_t frame_size = channels * sizeof(int16_t);
+    int16_t out[64];
+    size_t num_out = 0;
+
+    for (size_t i = 0; i < len;) {
+        // Gather a whole frame, as frames can be split across writes
+        size_t n = min(frame_size - frame_bytes, len - i);
+        memcpy((uint8_t *)frame + frame_bytes, data + i, n);
+        frame_bytes += n;
+        i += n;
+        if (frame_bytes < frame_size) {
+            break;
         }
+        frame_bytes = 0;
 
-        // Octave
-        if (notes[0] == 'O' || notes[0] == 'o') {
-            int new_octave = notes[1] - '0';
-            if (new_octave >= 4 && new_octave <= 7) {
-                octave = new_octave;
+        int32_t sum = 0;
+        for (int c = 0; c < channels; c++) {
+            sum += frame[c];
+        }
+        int16_t sample = sum / channels;
+
+        // Output every sample that falls between the previous input sample and this one
+        while (phase < 0x10000) {
+            out[num_out++] = previous + (((sample - previous) * (int32_t)(phase >> 1)) >> 15);
+            if (num_out == sizeof(out) / sizeof(out[0])) {
+                emit(out, num_out);
+                num_out = 0;
             }
-            notes.erase(0, 2);
-            continue;
+            phase += step;
+        }
+        phase -= 0x10000;
+        previous = sample;
+    }
+
+    if (num_out) {
+        emit(out, num_out);
+    }
+    return len;
+}
+
+void FileChannelWriter::emit(const int16_t *samples, size_t num_samples) {
+    for (size_t i = 0; i < num_samples && file_fifo_count < FILE_FIFO_SAMPLES; i++) {
+        file_fifo[(file_fifo_start + file_fifo_count) % FILE_FIFO_SAMPLES] = samples[i];
+        file_fifo_count++;
+    }
+}
+
+void CacheWriter::emit(const int16_t *samples, size_t num_samples) {
+    if (failed) {
+        return;
+    }
+
+    if (length + num_samples > capacity) {
+        size_t new_capacity = max(capacity * 2, length + num_samples);
+        int16_t *new_buffer = (int16_t *)heap_caps_realloc(buffer, new_capacity * sizeof(int16_t),
+                                                           MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!new_buffer) {
+            new_buffer = (int16_t *)heap_caps_realloc(buffer, new_capacity * sizeof(int16_t),
+                                                      MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        }
+        if (!new_buffer) {
+            failed = true;
+            return;
         }
+        buffer = new_buffer;
+        capacity = new_capacity;
+    }
+
+    memcpy(buffer + length, samples, num_samples * sizeof(int16_t));
+    length += num_samples;
+}
+
+// Mixes the next block from every channel. Returns false if nothing is playing.
+bool mix_block(int16_t *mix) {
+    alignas(16) int16_t samples[MIX_BLOCK_SAMPLES];
+    bool playing = false;
+
+    memset(mix, 0, MIX_BLOCK_SAMPLES * sizeof(int16_t));
+
+    int num_samples = mix_notes(samples, MIX_BLOCK_SAMPLES);
+    if (num_samples) {
+        YDSP::mix(mix, samples, num_samples, channel_gain[CHANNEL_NOTES]);
+        playing = true;
+#if YAUDIO_STATS
+        record_first_samples(CHANNEL_NOTES);
+#endif
+    }
+
+    num_samples = mix_file(samples, MIX_BLOCK_SAMPLES);
+    if (num_samples) {
+        YDSP::mix(mix, samples, num_samples, channel_gain[CHANNEL_SOUND_FILE]);
+        playing = true;
+#if YAUDIO_STATS
+        record_first_samples(CHANNEL_SOUND_FILE);
+#endif
+    }
+
+    start_effects();
+    for (int i = 0; i < NUM_EFFECT_CHANNELS; i++) {
+        num_samples = mix_effect(effect_channels[i], samples, MIX_BLOCK_SAMPLES);
+        if (num_samples) {
+            YDSP::mix(mix, samples, num_samples, channel_gain[CHANNEL_SOUND_EFFECTS]);
+            playing = true;
+#if YAUDIO_STATS
+            record_first_samples(CHANNEL_SOUND_EFFECTS);
+#endif
+        }
+    }
+
+    return playing;
+}
 
-        // Tempo
-        if (notes[0] == 'T' || notes[0] == 't') {
-            notes.erase(0, 1);
-            size_t pos;
-            int new_tempo = std::stoi(notes, &pos);
-            notes = notes.substr(pos);
-            if (new_tempo >= 40 && new_tempo <= 240) {
-                beats_per_minute = new_tempo;
+// Each of the mix functions fills the buffer with up to num_samples samples from its channel, and
+// returns the number of samples. The rest of the block is silent.
+int mix_notes(int16_t *buffer, int num_samples) {
+    bool starting = !notes_channel_active;
+    int count = 0;
+
+    while (count < num_samples) {
+        // Start the next note when this one is done, or right away if stop_speaker was called
+        if (tone_samples_left == 0 ||
+            note_queue_flush.load(std::memory_order_acquire) != tone_flush) {
+            tone_flush = note_queue_flush.load(std::memory_order_acquire);
+            YNotes::note note;
+            if (!pop_note(note)) {
+                tone_samples_left = 0;
+                break;
             }
+            start_tone(note);
+            tone_samples_left = note.duration;
             continue;
         }
 
-        // Reset
-        if (notes[0] == '!') {
-            set_note_defaults();
-            notes.erase(0, 1);
-            continue;
+        int n = min(num_samples - count, (int)min(tone_samples_left, (uint32_t)num_samples));
+        render_tones(buffer + count, n);
+        count += n;
+        tone_samples_left -= n;
+    }
+
+    if (count == 0) {
+        if (notes_channel_active || playing_tones) {
+            // If all of the notes have been played, signal that we are done
+            playing_tones = false;
+            notes_channel_active = false;
+            set_channel_done(CHANNEL_NOTES);
+        }
+        return 0;
+    }
+
+    if (starting) {
+        YDSP::fade(buffer, min(count, FADE_SAMPLES), 0, YDSP::Q15_ONE);
+    }
+    if (count < num_samples) {
+        int n = min(count, FADE_SAMPLES);
+        YDSP::fade(buffer + count - n, n, YDSP::Q15_ONE, 0);
+    }
+    notes_channel_active = true;
+    return count;
+}
+
+int mix_file(int16_t *buffer, int num_samples) {
+    if (file_state.load() != FILE_ACTIVE) {
+        file_state_t requested = FILE_REQUESTED;
+        if (!file_state.compare_exchange_strong(requested, FILE_ACTIVE)) {
+            return 0;
+        }
+        file_fifo_start = 0;
+        file_fifo_count = 0;
+        file_decoder_ended = false;
+        file_starved = false;
+        file_writer.start();
+
+        // Start reading ahead
+        streaming_file = true;
+        stream_start = true;
+        xTaskNotifyGive(sd_reader_task_handle);
+    }
+
+    if (file_generation.load() != file_request_generation) {
+        end_file();
+        return 0;
+    }
+
+    // Decode until there is a whole block, or the reader falls behind. The decoder writes into
+    // the file FIFO.
+    while (file_fifo_count < (size_t)num_samples && !file_decoder_ended) {
+        uint32_t head = stream_head.load(std::memory_order_relaxed);
+        size_t fill_level = stream_tail.load(std::memory_order_acquire) - head;
+
+        if (fill_level == 0) {
+            if (stream_eof) {
+                // End the decoder so it gives up any audio it is still holding
+                file_decoder->end();
+                file_decoder_ended = true;
+                continue;
+            }
+
+            // The reader fell behind, so leave a gap rather than hold up the other channels.
+            // Running dry before the first byte is just the buffer filling up.
+            if (head != 0 && !file_starved) {
+                stream_underruns++;
+            }
+            file_starved = true;
+            break;
+        }
+        file_starved = false;
+        stream_min_fill_level = min(stream_min_fill_level, fill_level);
+
+        // Decode straight out of the buffer, up to where it wraps around
+        size_t offset = head % stream_buffer_size;
+        size_t len = min(min(fill_level, stream_buffer_size - offset), FILE_CHUNK_SIZE);
+        file_decoder->write(stream_buffer + offset, len);
+
+        stream_head.store(head + len, std::memory_order_release);
+        xTaskNotifyGive(sd_reader_task_handle);
+    }
+
+    int count = min(file_fifo_count, (size_t)num_samples);
+    for (int i = 0; i < count; i++) {
+        buffer[i] = file_fifo[(file_fifo_start + i) % FILE_FIFO_SAMPLES];
+    }
+    file_fifo_start = (file_fifo_start + count) % FILE_FIFO_SAMPLES;
+    file_fifo_count -= count;
+
+    if (file_decoder_ended && file_fifo_count == 0) {
+        end_file();
+    }
+
+    // Keep the channel going through a gap, so the gap is heard instead of skipped over
+    if (count == 0 && file_state.load() == FILE_ACTIVE) {
+        memset(buffer, 0, num_samples * sizeof(int16_t));
+        return num_samples;
+    }
+    return count;
+}
+
+void stop_file() {
+    file_generation++;
+
+    // If the speaker task hasn't picked up the file yet, nothing has started reading it
+    file_state_t requested = FILE_REQUESTED;
+    if (file_state.compare_exchange_strong(requested, FILE_IDLE)) {
+        sound_file.close();
+        xSemaphoreGive(sd_reader_done);
+        set_channel_done(CHANNEL_SOUND_FILE);
+    }
+}
+
+void end_file() {
+    if (!file_decoder_ended) {
+        file_decoder->end();
+    }
+
+    // Stop the reader, which closes the file
+    streaming_file = false;
+    xTaskNotifyGive(sd_reader_task_handle);
+
+    file_state = FILE_IDLE;
+    set_channel_done(CHANNEL_SOUND_FILE);
+}
+
+int mix_effect(effect_channel_t &channel, int16_t *buffer, int num_samples) {
+    if (!channel.sound) {
+        return 0;
+    }
+
+    // The sound is already decoded in the mixer format, so it is just copied
+    int count = min(channel.sound->num_samples - channel.position, (size_t)num_samples);
+    memcpy(buffer, channel.sound->pcm + channel.position, count * sizeof(int16_t));
+    channel.position += count;
+
+    if (channel.position == channel.sound->num_samples) {
+        release_effect(channel);
+    }
+    return count;
+}
+
+void start_effects() {
+    // Stop everything if stop_speaker was called
+    uint32_t generation = effects_generation.load();
+    if (generation != effects_generation_playing) {
+        effects_generation_playing = generation;
+        for (int i = 0; i < NUM_EFFECT_CHANNELS; i++) {
+            release_effect(effect_channels[i]);
         }
+    }
 
-        // Volume
-        if (notes[0] == 'V' || notes[0] == 'v') {
-            notes.erase(0, 1);
-            size_t pos;
-            int new_volume = std::stoi(notes, &pos);
-            notes = notes.substr(pos);
-            if (new_volume >= 1 && new_volume <= 10) {
-                volume_notes = new_volume;
+    effect_request_t request;
+    while (xQueueReceive(effect_requests, &request, 0) == pdTRUE) {
+        if (request.generation != generation) {
+            request.sound->users--;
+            if (--effects_pending == 0) {
+                set_channel_done(CHANNEL_SOUND_EFFECTS);
             }
             continue;
         }
 
-        duration_s = (60.0 / beats_per_minute); // Quarter note duration in seconds
-
-        // A-G regular notes
-        // R for rest
-        // z for end rest, which is added internally to stop speaker crackle at the end
-        if ((notes[0] >= 'A' && notes[0] <= 'G') || (notes[0] >= 'a' && notes[0] <= 'g') ||
-            notes[0] == 'R' || notes[0] == 'r' || notes[0] == 'z') {
-            switch (notes[0]) {
-            case 'A':
-            case 'a':
-                note_freq = 440.0;
-                break;
-            case 'B':
-            case 'b':
-                note_freq = 493.88;
-                break;
-            case 'C':
-            case 'c':
-                note_freq = 523.25;
-                break;
-            case 'D':
-            case 'd':
-                note_freq = 587.33;
-                break;
-            case 'E':
-            case 'e':
-                note_freq = 659.25;
-                break;
-            case 'F':
-            case 'f':
-                note_freq = 698.46;
-                break;
-            case 'G':
-            case 'g':
-                note_freq = 783.99;
-                break;
-            case 'z':
-                duration_s = 0.2;
-                // Fallthrough
-            case 'R':
-            case 'r':
-                note_freq = 0;
+        // Use a free channel, or take over the one that has been playing the longest
+        effect_channel_t *channel = &effect_channels[0];
+        for (int i = 0; i < NUM_EFFECT_CHANNELS; i++) {
+            if (!effect_channels[i].sound) {
+                channel = &effect_channels[i];
                 break;
             }
+            if ((int32_t)(effect_channels[i].started - channel->started) < 0) {
+                channel = &effect_channels[i];
+            }
+        }
+        release_effect(*channel);
 
-            // Adjust frequency for octave
-            note_freq *= pow(2, octave - 4);
-            notes.erase(0, 1);
-
-            float dot_duration = duration_s;
-
-            // Note modifiers
-            while (1) {
-
-                // Duration
-                if (isdigit(notes[0])) {
-                    size_t pos;
-                    int frac_duration = std::stoi(notes, &pos);
-                    notes = notes.substr(pos);
-                    if (frac_duration >= 1 && frac_duration <= 2000) {
-                        duration_s = duration_s * (4.0 / frac_duration);
-                    }
-                    continue;
-                }
-
-                // Dot
-                if (notes[0] == '.') {
-                    dot_duration /= 2;
-                    duration_s += dot_duration;
-                    notes.erase(0, 1);
-                    continue;
-                }
-
-                // Octave
-                if (notes[0] == '>') {
-                    note_freq *= 2;
-                    notes.erase(0, 1);
-                    continue;
-                }
-                if (notes[0] == '<') {
-                    note_freq /= 2;
-                    notes.erase(0, 1);
-                    continue;
-                }
-
-                // Sharp/flat
-                if (notes[0] == '#' || notes[0] == '+' || notes[0] == '-') {
-                    if (notes[0] == '#' || notes[0] == '+') {
-                        note_freq *= pow(2, 1.0 / 12);
-                    } else {
-                        note_freq /= pow(2, 1.0 / 12);
-                    }
-                    notes.erase(0, 1);
-                    continue;
-                }
+        channel->sound = request.sound;
+        channel->position = 0;
+        channel->started = effects_started++;
+    }
+}
 
-                break;
+void release_effect(effect_channel_t &channel) {
+    if (!channel.sound) {
+        return;
+    }
+
+    channel.sound->users--;
+    channel.sound = NULL;
+    if (--effects_pending == 0) {
+        set_channel_done(CHANNEL_SOUND_EFFECTS);
+    }
+}
+
+// Fills in the WAV header for the recording, and returns its size
+size_t fill_wav_header(uint8_t *header, uint32_t data_size) {
+    uint8_t *p = header;
+    auto put_tag = [&p](const char *tag) {
+        memcpy(p, tag, 4);
+        p += 4;
+    };
+    auto put_u16 = [&p](uint16_t value) {
+        memcpy(p, &value, sizeof(value));
+        p += sizeof(value);
+    };
+    auto put_u32 = [&p](uint32_t value) {
+        memcpy(p, &value, sizeof(value));
+        p += sizeof(value);
+    };
+
+    bool adpcm = recordingCodec == CODEC_IMA_ADPCM;
+    uint16_t channels = recordingInfo.channels;
+    uint32_t sample_rate = recordingInfo.sample_rate;
+    uint16_t block_align = adpcm ? ADPCM_BLOCK_SIZE : channels * recordingInfo.bits_per_sample / 8;
+    uint32_t byte_rate = adpcm ? sample_rate * ADPCM_BLOCK_SIZE / ADPCM_SAMPLES_PER_BLOCK
+                               : sample_rate * block_align;
+    size_t header_size = adpcm ? MAX_WAV_HEADER_SIZE : 44;
+
+    put_tag("RIFF");
+    put_u32(header_size - 8 + data_size);
+    put_tag("WAVE");
+
+    put_tag("fmt ");
+    put_u32(adpcm ? 20 : 16);
+    put_u16(adpcm ? 0x11 : 1); // IMA-ADPCM or PCM
+    put_u16(channels);
+    put_u32(sample_rate);
+    put_u32(byte_rate);
+    put_u16(block_align);
+    put_u16(adpcm ? 4 : recordingInfo.bits_per_sample);
+
+    if (adpcm) {
+        put_u16(2);
+        put_u16(ADPCM_SAMPLES_PER_BLOCK);
+
+        // Compressed formats need the number of samples, as the last block is padded out
+        put_tag("fact");
+        put_u32(4);
+        put_u32(recording_num_samples);
+
+        // Pad the header out to its full size
+        size_t junk_size = header_size - (p - header) - 16;
+        put_tag("JUNK");
+        put_u32(junk_size);
+        memset(p, 0, junk_size);
+        p += junk_size;
+    }
+
+    put_tag("data");
+    put_u32(data_size);
+
+    return header_size;
+}
+
+// Converts the samples from the mic to the recording format, and adds them to the recording
+void encode_samples(const int16_t *samples, size_t num_samples) {
+    if (recordingCodec == CODEC_IMA_ADPCM) {
+        while (num_samples) {
+            size_t n = min(num_samples, ADPCM_SAMPLES_PER_BLOCK - adpcm_num_samples);
+            memcpy(adpcm_samples + adpcm_num_samples, samples, n * sizeof(int16_t));
+            adpcm_num_samples += n;
+            samples += n;
+            num_samples -= n;
+
+            if (adpcm_num_samples == ADPCM_SAMPLES_PER_BLOCK) {
+                uint8_t block[ADPCM_BLOCK_SIZE];
+                encode_adpcm_block(adpcm_samples, block);
+                record_bytes(block, sizeof(block));
+                adpcm_num_samples = 0;
+            }
+        }
+    } else if (recordingInfo.bits_per_sample == 8) {
+        // 8-bit WAV samples are unsigned
+        uint8_t bytes[CAPTURE_SAMPLES];
+        while (num_samples) {
+            size_t n = min(num_samples, CAPTURE_SAMPLES);
+            for (size_t i = 0; i < n; i++) {
+                bytes[i] = (samples[i] >> 8) + 128;
             }
-            return {(unsigned int)round(note_freq), (unsigned int)(duration_s * 1000)};
+            record_bytes(bytes, n);
+            samples += n;
+            num_samples -= n;
+        }
+    } else {
+        record_bytes((const uint8_t *)samples, num_samples * sizeof(int16_t));
+    }
+}
+
+void record_bytes(const uint8_t *data, size_t len) {
+    while (len) {
+        size_t n = min(len, RECORD_BLOCK_SIZE - record_block.len);
+        memcpy(record_block.data + record_block.len, data, n);
+        record_block.len += n;
+        data += n;
+        len -= n;
+
+        if (record_block.len == RECORD_BLOCK_SIZE) {
+            next_record_block();
         }
+    }
+}
 
-        // If we reach here then we have a syntax error
-        Serial.printf("Syntax error in notes: %s\n", notes.c_str());
-        notes.clear();
-        break;
+// Hands the current block to the writer and starts on the next one. If there isn't a free one,
+// the writer has fallen behind, so the current block's audio is dropped and the block is reused.
+void next_record_block() {
+    uint8_t *next;
+    if (xQueueReceive(record_free_blocks, &next, 0) != pdTRUE) {
+        // The block's audio never reaches the file, so it doesn't count towards its length. The
+        // recordings are mono, and blocks hold whole ADPCM blocks.
+        size_t dropped = record_block.len - record_block_start;
+        recording_num_samples -= recordingCodec == CODEC_IMA_ADPCM
+                                     ? dropped / ADPCM_BLOCK_SIZE * ADPCM_SAMPLES_PER_BLOCK
+                                     : dropped / (recordingInfo.bits_per_sample / 8);
+        recording_overruns++;
+        record_block.len = record_block_start;
+        return;
     }
 
-    return {0, 0};
+    xQueueSend(record_full_blocks, &record_block, portMAX_DELAY);
+    record_block.data = next;
+    record_block.len = 0;
+    record_block_start = 0;
+}
+
+void encode_adpcm_block(const int16_t *samples, uint8_t *block) {
+    // The block header holds the first sample exactly, and the current step index
+    int predictor = samples[0];
+    block[0] = predictor & 0xFF;
+    block[1] = (predictor >> 8) & 0xFF;
+    block[2] = adpcm_index;
+    block[3] = 0;
+    memset(block + 4, 0, ADPCM_BLOCK_SIZE - 4);
+
+    for (size_t i = 1; i < ADPCM_SAMPLES_PER_BLOCK; i++) {
+        // Encode the difference from the prediction in units of the step size
+        int step = adpcm_step_table[adpcm_index];
+        int diff = samples[i] - predictor;
+        uint8_t nibble = 0;
+        if (diff < 0) {
+            nibble = 8;
+            diff = -diff;
+        }
+
+        // Track the value the decoder will reconstruct, so errors don't build up
+        int delta = step >> 3;
+        if (diff >= step) {
+            nibble |= 4;
+            diff -= step;
+            delta += step;
+        }
+        step >>= 1;
+        if (diff >= step) {
+            nibble |= 2;
+            diff -= step;
+            delta += step;
+        }
+        step >>= 1;
+        if (diff >= step) {
+            nibble |= 1;
+            delta += step;
+        }
+
+        predictor += (nibble & 8) ? -delta : delta;
+        predictor = constrain(predictor, INT16_MIN, INT16_MAX);
+        adpcm_index = constrain(adpcm_index + adpcm_index_table[nibble], 0, 88);
+
+        // Samples are packed two per byte, the first one in the low nibble
+        block[4 + (i - 1) / 2] |= (i % 2) ? nibble : (nibble << 4);
+    }
 }
 
-void set_wave_volume(uint8_t new_volume) { speakerVolume.setVolume(new_volume / 10.0); }
+bool channel_playing(audio_channel channel) {
+    switch (channel) {
+    case CHANNEL_NOTES:
+        return playing_tones || notes_pending() || notes_channel_active;
+    case CHANNEL_SOUND_FILE:
+        return file_state.load() != FILE_IDLE;
+    case CHANNEL_SOUND_EFFECTS:
+        return effects_pending > 0;
+    default:
+        return false;
+    }
+}
+
+void set_channel_done(audio_channel channel) {
+    xEventGroupSetBits(speaker_events, BIT0 << channel);
+}
+
+// Done before the channel counts as playing, so waiting for the new sound doesn't return early
+void clear_channel_done(audio_channel channel) {
+    xEventGroupClearBits(speaker_events, BIT0 << channel);
+}
+
+// Opens a sound file, with or without a / at the start of the name
+sound_format_t open_sound_file(const char *filename, File &file) {
+    // Files in the index already have their format, so they only need to be opened
+    const file_entry_t *entry = find_indexed_file(filename);
+    if (entry) {
+        file = file_system->open(&file_index_paths[entry->path_offset]);
+        if (file) {
+            return entry->format;
+        }
+    }
+
+    if (filename[0] == '/') {
+        file = file_system->open(filename);
+    } else {
+        file = file_system->open(("/" + std::string(filename)).c_str());
+    }
+    if (!file) {
+        Serial.printf("Error opening file: %s\n", filename);
+        return FORMAT_UNKNOWN;
+    }
+
+    sound_format_t format = read_sound_format(file);
+    if (format == FORMAT_UNKNOWN) {
+        LOGE("Unknown file type");
+        file.close();
+    }
+    return format;
+}
+
+// Sniffs the format from the start of the file, and leaves the file at the start
+sound_format_t read_sound_format(File &file) {
+    uint8_t start[4] = {};
+    file.read(start, sizeof(start));
+    file.seek(0);
+
+    if (start[0] == 0xFF || start[0] == 0xFE || strncmp("ID3", (const char *)start, 3) == 0) {
+        return FORMAT_MP3;
+    }
+    if (strncmp("RIFF", (const char *)start, 4) == 0) {
+        return FORMAT_WAV;
+    }
+    return FORMAT_UNKNOWN;
+}
+
+void index_directory(File &directory, int depth) {
+    File entry;
+    while ((entry = directory.openNextFile())) {
+        const char *path = entry.path();
+        const char *name = strrchr(path, '/');
+        name = name ? name + 1 : path;
+
+        // Skip hidden files and system folders
+        if (name[0] == '.' || strcmp(name, "System Volume Information") == 0) {
+            entry.close();
+            continue;
+        }
+
+        if (entry.isDirectory()) {
+            if (depth < MAX_FILE_INDEX_DEPTH) {
+                index_directory(entry, depth + 1);
+            }
+        } else if (has_sound_extension(name)) {
+            // The file is already open from the directory listing, so read its format now
+            sound_format_t format = read_sound_format(entry);
+            if (format != FORMAT_UNKNOWN) {
+                file_entry_t file_entry = {hash_path(path), (uint32_t)file_index_paths.size(),
+                                           format};
+                file_index.push_back(file_entry);
+                file_index_paths.insert(file_index_paths.end(), path, path + strlen(path) + 1);
+            }
+        }
+        entry.close();
+    }
+}
+
+bool has_sound_extension(const char *path) {
+    const char *extension = strrchr(path, '.');
+    return extension && (strcasecmp(extension, ".wav") == 0 || strcasecmp(extension, ".mp3") == 0);
+}
+
+// FNV-1a, ignoring the / at the start so names can be looked up with or without it
+uint32_t hash_path(const char *path) {
+    if (path[0] == '/') {
+        path++;
+    }
+
+    uint32_t hash = 2166136261u;
+    for (; *path; path++) {
+        hash = (hash ^ (uint8_t)*path) * 16777619u;
+    }
+    return hash;
+}
+
+const file_entry_t *find_indexed_file(const char *filename) {
+    if (!file_index_ready || file_index.empty()) {
+        return NULL;
+    }
+
+    uint32_t hash = hash_path(filename);
+    const char *name = filename[0] == '/' ? filename + 1 : filename;
+    uint32_t mask = file_index_slots.size() - 1;
+    for (uint32_t slot = hash & mask; file_index_slots[slot] >= 0; slot = (slot + 1) & mask) {
+        const file_entry_t &entry = file_index[file_index_slots[slot]];
+        // Stored paths always start with a /
+        if (entry.hash == hash && strcmp(&file_index_paths[entry.path_offset + 1], name) == 0) {
+            return &entry;
+        }
+    }
+    return NULL;
+}
+
+bool make_room_in_cache(size_t num_samples) {
+    size_t cache_limit =
+        (psramFound() ? SOUND_CACHE_SIZE : FALLBACK_SOUND_CACHE_SIZE) / sizeof(int16_t);
+    if (num_samples > cache_limit) {
+        return false;
+    }
 
-void play_speaker_task(void *params) {
     while (1) {
-        // Block waiting for something to do
-        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // Find an empty slot, and the least recently played sound in case there isn't room.
+        // Sounds that are playing can't be removed.
+        cached_sound_t *empty = NULL;
+        cached_sound_t *oldest = NULL;
+        for (int i = 0; i < MAX_CACHED_SOUNDS; i++) {
+            cached_sound_t *sound = &sound_cache[i];
+            if (!sound->id) {
+                empty = sound;
+            } else if (sound->users == 0 &&
+                       (!oldest || (int32_t)(sound->last_used - oldest->last_used) < 0)) {
+                oldest = sound;
+            }
+        }
+
+        if (empty && sound_cache_size + num_samples <= cache_limit) {
+            return true;
+        }
+        if (!oldest) {
+            return false;
+        }
+
+        heap_caps_free(oldest->pcm);
+        sound_cache_size -= oldest->num_samples;
+        oldest->id = 0;
+    }
+}
 
-        if (playing_tones) {
-            // Setup sine wave
-            sineWave.begin(sineInfo);
+void sd_reader_task(void *params) {
+    while (1) {
+        // Block waiting for a file to read. Other notifications are just the speaker task making
+        // room in the buffer.
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!stream_start) {
+            continue;
+        }
+        stream_start = false;
 
-            // Start the audio stream
-            copier.begin(speakerOut, toneStream);
+        while (streaming_file && !stream_eof) {
+            uint32_t tail = stream_tail.load(std::memory_order_relaxed);
+            uint32_t head = stream_head.load(std::memory_order_acquire);
+            size_t space = stream_buffer_size - (tail - head);
 
-            // Play all the notes until there are none left
-            while (notes.length()) {
-                xSemaphoreTake(notes_mutex, portMAX_DELAY);
-                note_t note = parse_next_note();
-                xSemaphoreGive(notes_mutex);
+            // Wait for the speaker task to make room for a whole read
+            if (space < SD_READ_SIZE) {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                continue;
+            }
 
-                // Play the tone and wait for it to finish
-                sineWave.setFrequency(note.frequency);
-                sineWave.setAmplitude(16000 * (volume_notes / 10.0));
+            size_t len = sound_file.read(stream_buffer + (tail % stream_buffer_size), SD_READ_SIZE);
+            stream_tail.store(tail + len, std::memory_order_release);
 
-                // Copy during the note duration
-                int start_time = millis();
-                while ((millis() - start_time) < note.duration) {
-                    copier.copy(poppingRemover);
-                }
+            if (len < SD_READ_SIZE) {
+                stream_eof = true;
             }
+        }
 
-            // If all of the notes have been played, signal that we are done
-            playing_tones = false;
+        // Wait for the speaker task to finish with the file before closing it
+        while (streaming_file) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+        sound_file.close();
+        xSemaphoreGive(sd_reader_done);
+    }
+}
+
+void set_wave_volume(uint8_t new_volume) { set_channel_volume(CHANNEL_SOUND_FILE, new_volume); }
+
+void play_speaker_task(void *params) {
+    // Aligned for the vector mixing in YDSP
+    alignas(16) int16_t mix[MIX_BLOCK_SAMPLES];
+#if YAUDIO_STATS
+    bool writing = false;
+    uint32_t last_write_end = 0;
+#endif
+
+    while (1) {
+        uint32_t block_start = micros();
+#if YAUDIO_STATS
+        stats_timer_t mix_timer = start_stats_timer();
+#endif
+        bool mixed = mix_block(mix);
+
+        // Block waiting for something to do
+        if (!mixed) {
+#if YAUDIO_STATS
+            writing = false;
+#endif
+            if (!wait_for_work(speaker_running)) {
+                speakerOut.end();
+                speaker_running = false;
+            }
+            continue;
         }
 
-        if (playing_file) {
-            // Keep copying until the file and copier is done
-            while (playing_file &&
-                   !(copier.copy(poppingRemover) == 0 && sound_file.available() == 0))
-                ;
-            playing_file = false;
+#if YAUDIO_STATS
+        stop_stats_timer(mix_timer, pipeline_stats.mix_time);
+
+        // If the last write was longer ago than the DMA buffers last, the speaker ran out
+        uint32_t write_start = micros();
+        if (writing && write_start - last_write_end > speaker_dma_us) {
+            portENTER_CRITICAL(&stats_lock);
+            pipeline_stats.speaker_underruns++;
+            portEXIT_CRITICAL(&stats_lock);
         }
+#endif
+
+        // Writing blocks until the I2S DMA buffers have room, which paces the mixer and lets
+        // other tasks run in the meantime
+        if (speaker_running) {
+            speakerOut.write((uint8_t *)mix, sizeof(mix));
+        } else {
+            restart_speaker(block_start, mix, sizeof(mix));
+        }
+#if YAUDIO_STATS
+        last_write_end = micros();
+        writing = true;
+#endif
     }
 }
+
+// Waits for the task to be notified. With power save on and the device running, gives up after
+// power_save_ms and returns false, so the task can stop its device.
+bool wait_for_work(std::atomic<bool> &running) {
+    uint32_t idle_ms = power_save_ms;
+    if (!idle_ms || !running) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        return true;
+    }
+    return ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(idle_ms)) > 0;
+}
+
+// Starts the speaker again after power save stopped it, and writes the first block to it
+void restart_speaker(uint32_t woke_at, const int16_t *mix, size_t len) {
+    speakerOut.begin(speakerConfig);
+    speaker_running = true;
+    speakerOut.write((const uint8_t *)mix, len);
+
+    uint32_t restart_us = micros() - woke_at;
+    portENTER_CRITICAL(&power_stats_lock);
+    speaker_power_stats.speaker_restarts++;
+    speaker_power_stats.last_restart_us = restart_us;
+    speaker_power_stats.max_restart_us = max(speaker_power_stats.max_restart_us, restart_us);
+    portEXIT_CRITICAL(&power_stats_lock);
+}
 }; // namespace YAudio
@@ -1,35 +1,117 @@
 #include "yboard.h"
 
+#include <esp_sleep.h>
+
 YBoardV3 Yboard;
 
+// With async setup, each group of devices is set up by its own task on core 0
+static const BaseType_t SETUP_TASK_CORE = 0;
+static const UBaseType_t SETUP_TASK_PRIORITY = 1;
+static const uint32_t SETUP_TASK_STACK_SIZE = 4096;
+
+// Both SD drivers mount the card here, so file paths work the same with either
+static const char *SD_MOUNT_POINT = "/sd";
+static const uint32_t SD_FALLBACK_SPI_FREQUENCY = 4000000;
+
+// The speed test uses the same size writes as recordings
+static const char *SD_TEST_FILE = "/yboard_speed_test.bin";
+static const size_t SD_TEST_BLOCK_SIZE = 16 * 1024;
+
 YBoardV3::YBoardV3() : strip(led_count, led_pin, NEO_GRB + NEO_KHZ800), display(128, 32) {}
 
 YBoardV3::~YBoardV3() {}
 
-void YBoardV3::setup() {
+void YBoardV3::setup() { setup(yboard_config()); }
+
+void YBoardV3::setup(const yboard_config &config) {
+    setup_config = config;
+
+    // Setting up again starts the progress over, in the same event group
+    if (setup_events) {
+        xEventGroupClearBits(setup_events, SUBSYSTEM_ALL | (SUBSYSTEM_ALL << SETUP_OK_SHIFT));
+    } else {
+        setup_events = xEventGroupCreate();
+    }
+
     setup_leds();
     setup_switches();
     setup_buttons();
-
-    if (setup_sd_card()) {
-        Serial.println("SD Card Setup: Success");
+    setup_knob();
+
+    // The microSD card is on SPI, the speaker and microphone are on I2S, and the accelerometer
+    // and display are on I2C, so each group can be set up without waiting for the others
+    if (config.async_setup) {
+        xTaskCreatePinnedToCore(storage_setup_task, "storage_setup_task", SETUP_TASK_STACK_SIZE,
+                                this, SETUP_TASK_PRIORITY, NULL, SETUP_TASK_CORE);
+        xTaskCreatePinnedToCore(audio_setup_task, "audio_setup_task", SETUP_TASK_STACK_SIZE, this,
+                                SETUP_TASK_PRIORITY, NULL, SETUP_TASK_CORE);
+        xTaskCreatePinnedToCore(i2c_setup_task, "i2c_setup_task", SETUP_TASK_STACK_SIZE, this,
+                                SETUP_TASK_PRIORITY, NULL, SETUP_TASK_CORE);
+    } else {
+        setup_storage();
+        setup_audio();
+        setup_i2c_devices();
     }
+}
 
-    if (setup_speaker()) {
-        Serial.println("Speaker Setup: Success");
+bool YBoardV3::wait_for_setup(int subsystems, uint32_t timeout_ms) {
+    if (!setup_events) {
+        return false;
     }
 
-    if (setup_mic()) {
-        Serial.println("Mic Setup: Success");
+    TickType_t timeout = timeout_ms == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+    xEventGroupWaitBits(setup_events, subsystems, pdFALSE, pdTRUE, timeout);
+    return is_ready(subsystems);
+}
+
+bool YBoardV3::is_ready(int subsystems) {
+    if (!setup_events) {
+        return false;
     }
 
-    if (setup_accelerometer()) {
-        Serial.println("Accelerometer Setup: Success");
+    EventBits_t ok_bits = (EventBits_t)subsystems << SETUP_OK_SHIFT;
+    return (xEventGroupGetBits(setup_events) & ok_bits) == ok_bits;
+}
+
+void YBoardV3::storage_setup_task(void *params) {
+    ((YBoardV3 *)params)->setup_storage();
+    vTaskDelete(NULL);
+}
+
+void YBoardV3::audio_setup_task(void *params) {
+    ((YBoardV3 *)params)->setup_audio();
+    vTaskDelete(NULL);
+}
+
+void YBoardV3::i2c_setup_task(void *params) {
+    ((YBoardV3 *)params)->setup_i2c_devices();
+    vTaskDelete(NULL);
+}
+
+void YBoardV3::setup_storage() {
+    bool ok = setup_sd_card(setup_config.sd_card);
+    if (ok) {
+        YAudio::build_file_index();
     }
+    report_setup(SUBSYSTEM_SD_CARD, ok, "SD Card");
+}
+
+void YBoardV3::setup_audio() {
+    report_setup(SUBSYSTEM_SPEAKER, setup_speaker(setup_config.audio), "Speaker");
+    report_setup(SUBSYSTEM_MICROPHONE, setup_mic(setup_config.audio), "Mic");
+}
 
-    if (setup_display()) {
-        Serial.println("Display Setup: Success");
+void YBoardV3::setup_i2c_devices() {
+    report_setup(SUBSYSTEM_ACCELEROMETER, setup_accelerometer(setup_config.accelerometer),
+                 "Accelerometer");
+    report_setup(SUBSYSTEM_DISPLAY, setup_display(setup_config.display), "Display");
+}
+
+void YBoardV3::report_setup(yboard_subsystem subsystem, bool ok, const char *name) {
+    if (ok) {
+        Serial.printf("%s Setup: Success\n", name);
     }
+    xEventGroupSetBits(setup_events, ok ? subsystem | (subsystem << SETUP_OK_SHIFT) : subsystem);
 }
 
 ////////////////////////////// LEDs ///////////////////////////////
@@ -41,25 +123,121 @@ void YBoardV3::setup_leds() {
 
 void YBoardV3::set_led_color(uint16_t index, uint8_t red, uint8_t green, uint8_t blue) {
     strip.setPixelColor(index - 1, red, green, blue);
-    strip.show();
+    if (!led_frame_active) {
+        show_leds();
+    }
 }
 
 void YBoardV3::set_led_brightness(uint8_t brightness) {
     strip.setBrightness(brightness);
-    strip.show();
+    YLeds::set_animation_brightness(brightness);
+    if (!led_frame_active) {
+        show_leds();
+    }
 }
 
 void YBoardV3::set_all_leds_color(uint8_t red, uint8_t green, uint8_t blue) {
     for (int i = 0; i < this->led_count; i++) {
         strip.setPixelColor(i, red, green, blue, false);
     }
-    strip.show();
+    if (!led_frame_active) {
+        show_leds();
+    }
+}
+
+void YBoardV3::begin_led_frame() { led_frame_active = true; }
+
+void YBoardV3::commit_leds() {
+    led_frame_active = false;
+    show_leds();
+}
+
+bool YBoardV3::enable_async_leds() {
+    if (!leds_async) {
+        if (!YLeds::setup_async_output(led_pin, sizeof(shown_pixels))) {
+            Serial.println("ERROR: Async LED setup failed.");
+            return false;
+        }
+        leds_async = true;
+    }
+
+    return true;
+}
+
+int YBoardV3::start_led_animation(const YLeds::animation &animation) {
+    // Animations are drawn from a timer, so the LEDs have to update in the background
+    if (!enable_async_leds() || !YLeds::setup_animations(setup_config.led_frame_rate)) {
+        Serial.println("ERROR: LED animation setup failed.");
+        return -1;
+    }
+
+    int id = YLeds::start_animation(animation);
+    if (id < 0) {
+        Serial.println("ERROR: LED animation could not be started.");
+    }
+    return id;
+}
+
+int YBoardV3::start_led_breathing(uint8_t red, uint8_t green, uint8_t blue, uint32_t period_ms) {
+    YLeds::animation animation;
+    animation.keyframes[0] = {0, 0, 0, 0};
+    animation.keyframes[1] = {period_ms / 2, red, green, blue};
+    animation.num_keyframes = 2;
+    animation.period_ms = period_ms;
+    return start_led_animation(animation);
+}
+
+int YBoardV3::start_led_chase(uint8_t red, uint8_t green, uint8_t blue, uint32_t period_ms) {
+    // Each LED lights up one step after the one before it, and fades out over the next 3 steps
+    uint32_t step_ms = max(period_ms / led_count, (uint32_t)1);
+    YLeds::animation animation;
+    animation.effect = YLeds::EFFECT_CHASE;
+    animation.keyframes[0] = {0, 0, 0, 0};
+    animation.keyframes[1] = {step_ms, red, green, blue};
+    animation.keyframes[2] = {4 * step_ms, 0, 0, 0};
+    animation.num_keyframes = 3;
+    animation.period_ms = step_ms * led_count;
+    animation.led_offset_ms = step_ms;
+    return start_led_animation(animation);
+}
+
+int YBoardV3::start_led_rainbow(uint32_t period_ms) {
+    YLeds::animation animation;
+    animation.effect = YLeds::EFFECT_RAINBOW;
+    animation.period_ms = period_ms;
+    return start_led_animation(animation);
+}
+
+void YBoardV3::stop_led_animation(int id) { YLeds::stop_animation(id); }
+
+void YBoardV3::stop_all_led_animations() { YLeds::stop_all_animations(); }
+
+void YBoardV3::show_leds() {
+    // The strip buffer already has brightness applied, so comparing it against what was last
+    // sent also catches brightness changes. Skip the update if nothing changed.
+    const uint8_t *pixels = strip.getPixels();
+    if (leds_shown && memcmp(pixels, shown_pixels, sizeof(shown_pixels)) == 0) {
+        return;
+    }
+
+    if (leds_async) {
+        YLeds::show_async(pixels);
+    } else {
+        strip.show();
+    }
+    memcpy(shown_pixels, pixels, sizeof(shown_pixels));
+    leds_shown = true;
 }
 
 ////////////////////////////// Switches ///////////////////////////////
 void YBoardV3::setup_switches() {
     pinMode(this->switch1_pin, INPUT);
     pinMode(this->switch2_pin, INPUT);
+
+    if (!YInputs::setup_input(YInputs::INPUT_SWITCH_1, switch1_pin, false, false) ||
+        !YInputs::setup_input(YInputs::INPUT_SWITCH_2, switch2_pin, false, false)) {
+        Serial.println("ERROR: Switch event setup failed.");
+    }
 }
 
 bool YBoardV3::get_switch(uint8_t switch_idx) {
@@ -77,6 +255,12 @@ bool YBoardV3::get_switch(uint8_t switch_idx) {
 void YBoardV3::setup_buttons() {
     pinMode(this->button1_pin, INPUT);
     pinMode(this->button2_pin, INPUT);
+
+    // The buttons read low when they are pressed
+    if (!YInputs::setup_input(YInputs::INPUT_BUTTON_1, button1_pin, true, true) ||
+        !YInputs::setup_input(YInputs::INPUT_BUTTON_2, button2_pin, true, true)) {
+        Serial.println("ERROR: Button event setup failed.");
+    }
 }
 
 bool YBoardV3::get_button(uint8_t button_idx) {
@@ -90,19 +274,42 @@ bool YBoardV3::get_button(uint8_t button_idx) {
     }
 }
 
+bool YBoardV3::poll_input_event(YInputs::input_event &event) { return YInputs::poll_event(event); }
+
+void YBoardV3::set_input_event_callback(YInputs::input_event_callback callback, void *arg) {
+    YInputs::set_event_callback(callback, arg);
+}
+
 ////////////////////////////// Knob ///////////////////////////////
+void YBoardV3::setup_knob() {
+    // The knob is sampled in the background
+    if (!YInputs::setup_knob(this->knob_pin, 2888, 8)) {
+        Serial.println("ERROR: Knob setup failed.");
+        return;
+    }
+    knob_sampled = true;
+}
+
 int YBoardV3::get_knob() {
+    if (knob_sampled) {
+        return YInputs::get_knob();
+    }
+
     int value = map(analogRead(this->knob_pin), 2888, 8, 0, 100);
     value = max(0, value);
     value = min(100, value);
     return value;
 }
 
+void YBoardV3::set_knob_callback(YInputs::knob_callback callback, int threshold, void *arg) {
+    YInputs::set_knob_callback(callback, threshold, arg);
+}
+
 ////////////////////////////// Speaker/Tones //////////////////////////////////
-bool YBoardV3::setup_speaker() {
+bool YBoardV3::setup_speaker(const YAudio::audio_config &config) {
 
     if (!YAudio::setup_speaker(speaker_i2s_ws_pin, speaker_i2s_bclk_pin, speaker_i2s_data_pin,
-                               speaker_i2s_port)) {
+                               speaker_i2s_port, config)) {
         Serial.println("ERROR: Speaker setup failed.");
         return false;
     }
@@ -111,18 +318,34 @@ bool YBoardV3::setup_speaker() {
 }
 
 bool YBoardV3::play_sound_file(const std::string &filename) {
+    return play_sound_file(filename.c_str());
+}
+
+bool YBoardV3::play_sound_file(const char *filename) {
     if (!play_sound_file_background(filename)) {
         return false;
     }
 
-    while (is_audio_playing()) {
-        delay(10);
-    }
+    YAudio::wait_for_channel(YAudio::CHANNEL_SOUND_FILE);
 
     return true;
 }
 
 bool YBoardV3::play_sound_file_background(const std::string &filename) {
+    return play_sound_file_background(filename.c_str());
+}
+
+bool YBoardV3::play_sound_file_background(const char *filename) {
+    if (!sd_card_present) {
+        Serial.println("ERROR: SD Card not present.");
+        return false;
+    }
+
+    // YAudio looks the file up in its index, with or without a / at the start
+    return YAudio::play_sound_file(filename);
+}
+
+int YBoardV3::preload_sound_file(const std::string &filename) {
     // Prepend filename with a / if it doesn't have one
     std::string _filename = filename;
     if (_filename[0] != '/') {
@@ -131,27 +354,34 @@ bool YBoardV3::play_sound_file_background(const std::string &filename) {
 
     if (!sd_card_present) {
         Serial.println("ERROR: SD Card not present.");
-        return false;
-    }
-
-    if (!SD.exists(_filename.c_str())) {
-        Serial.println("File does not exist.");
-        return false;
+        return -1;
     }
 
-    return YAudio::play_sound_file(_filename);
+    return YAudio::cache_sound_file(_filename);
 }
 
+bool YBoardV3::play_cached_sound(int sound_id) { return YAudio::play_cached_sound(sound_id); }
+
 void YBoardV3::set_sound_file_volume(uint8_t volume) { YAudio::set_wave_volume(volume); }
 
+void YBoardV3::set_sound_effect_volume(uint8_t volume) {
+    YAudio::set_channel_volume(YAudio::CHANNEL_SOUND_EFFECTS, volume);
+}
+
+bool YBoardV3::set_sound_file_buffer_size(size_t size) {
+    return YAudio::set_stream_buffer_size(size);
+}
+
+YAudio::stream_buffer_stats YBoardV3::get_sound_file_buffer_stats() {
+    return YAudio::get_stream_buffer_stats();
+}
+
 bool YBoardV3::play_notes(const std::string &notes) {
     if (!play_notes_background(notes)) {
         return false;
     }
 
-    while (is_audio_playing()) {
-        delay(10);
-    }
+    YAudio::wait_for_channel(YAudio::CHANNEL_NOTES);
 
     return true;
 }
@@ -165,8 +395,8 @@ bool YBoardV3::is_audio_playing() { return YAudio::is_playing(); }
 I2SStream &YBoardV3::get_speaker_stream() { return YAudio::get_speaker_stream(); }
 
 ////////////////////////////// Microphone ////////////////////////////////////////
-bool YBoardV3::setup_mic() {
-    if (!YAudio::setup_mic(mic_i2s_ws_pin, mic_i2s_data_pin, mic_i2s_port)) {
+bool YBoardV3::setup_mic(const YAudio::audio_config &config) {
+    if (!YAudio::setup_mic(mic_i2s_ws_pin, mic_i2s_data_pin, mic_i2s_port, config)) {
         Serial.println("ERROR: Mic setup failed.");
         return false;
     }
@@ -177,6 +407,11 @@ bool YBoardV3::setup_mic() {
 }
 
 bool YBoardV3::start_recording(const std::string &filename) {
+    return start_recording(filename, AudioInfo(44100, 1, 16), YAudio::CODEC_PCM);
+}
+
+bool YBoardV3::start_recording(const std::string &filename, const AudioInfo &info,
+                               YAudio::recording_codec codec) {
     // Prepend filename with a / if it doesn't have one
     std::string _filename = filename;
     if (_filename[0] != '/') {
@@ -188,25 +423,39 @@ bool YBoardV3::start_recording(const std::string &filename) {
         return false;
     }
 
-    return YAudio::start_recording(_filename);
+    return YAudio::start_recording(_filename, info, codec);
 }
 
 void YBoardV3::stop_recording() { YAudio::stop_recording(); }
 
 bool YBoardV3::is_recording() { return YAudio::is_recording(); }
 
+uint32_t YBoardV3::get_recording_overruns() { return YAudio::get_recording_overruns(); }
+
 void YBoardV3::set_recording_volume(uint8_t volume) { YAudio::set_recording_gain(volume); }
 
 I2SStream &YBoardV3::get_microphone_stream() { return YAudio::get_mic_stream(); }
 
-////////////////////////////// Accelerometer /////////////////////////////////////
-bool YBoardV3::setup_accelerometer() {
-    if (!wire_begin) {
-        Wire.begin(sda_pin, scl_pin);
-        wire_begin = true;
+void YBoardV3::set_microphone_callback(YAudio::mic_frame_callback callback, void *arg) {
+    YAudio::set_mic_callback(callback, arg);
+}
+
+////////////////////////////// I2C /////////////////////////////////////
+void YBoardV3::setup_i2c() {
+    if (!YI2C::setup(Wire, sda_pin, scl_pin, i2c_frequency)) {
+        Serial.println("Error starting I2C bus");
     }
+}
+
+bool YBoardV3::get_i2c_stats(uint8_t address, YI2C::device_stats &stats) {
+    return YI2C::get_stats(address, stats);
+}
+
+////////////////////////////// Accelerometer /////////////////////////////////////
+bool YBoardV3::setup_accelerometer(const YAccel::accelerometer_config &config) {
+    setup_i2c();
 
-    if (!accel.begin(accel_addr, Wire)) {
+    if (!YAccel::setup(accel_addr, config)) {
         Serial.println("WARNING: Accelerometer not detected.");
         return false;
     }
@@ -214,38 +463,189 @@ bool YBoardV3::setup_accelerometer() {
     return true;
 }
 
-bool YBoardV3::accelerometer_available() { return accel.available(); }
+bool YBoardV3::accelerometer_available() { return YAccel::available(); }
+
+accelerometer_data YBoardV3::get_accelerometer() { return YAccel::get_latest(); }
 
-accelerometer_data YBoardV3::get_accelerometer() {
-    accelerometer_data data;
-    data.x = accel.getX();
-    data.y = accel.getY();
-    data.z = accel.getZ();
-    return data;
+size_t YBoardV3::get_accelerometer_batch(accelerometer_data *samples, size_t max_samples) {
+    return YAccel::get_batch(samples, max_samples);
 }
 
-bool YBoardV3::setup_sd_card() {
-    // Set microSD Card CS as OUTPUT and set HIGH
-    pinMode(sd_cs_pin, OUTPUT);
-    digitalWrite(sd_cs_pin, HIGH);
+uint32_t YBoardV3::get_accelerometer_overruns() { return YAccel::get_overruns(); }
 
-    // Initialize SPI bus for microSD Card
-    SPI.begin(spi_sck_pin, spi_miso_pin, spi_mosi_pin);
+bool YBoardV3::poll_motion_event(YAccel::motion_event &event) {
+    return YAccel::poll_motion_event(event);
+}
 
-    // Start microSD Card
-    if (!SD.begin(sd_cs_pin)) {
-        Serial.println("Error accessing microSD card!");
-        sd_card_present = false;
-        return false;
+void YBoardV3::set_motion_event_callback(YAccel::motion_event_callback callback, void *arg) {
+    YAccel::set_motion_event_callback(callback, arg);
+}
+
+bool YBoardV3::setup_sd_card(const sd_card_config &config) {
+    if (config.use_sd_mmc) {
+        // The SPI lines double as the SD bus, with CS as D3 when the 4-bit bus is wired
+        bool one_bit = config.sd_mmc_d1_pin < 0 || config.sd_mmc_d2_pin < 0;
+        bool pins_set = one_bit ? SD_MMC.setPins(spi_sck_pin, spi_mosi_pin, spi_miso_pin)
+                                : SD_MMC.setPins(spi_sck_pin, spi_mosi_pin, spi_miso_pin,
+                                                 config.sd_mmc_d1_pin, config.sd_mmc_d2_pin,
+                                                 sd_cs_pin);
+        if (!pins_set || !SD_MMC.begin(SD_MOUNT_POINT, one_bit, false,
+                                       config.sd_mmc_frequency_khz, config.max_open_files)) {
+            Serial.println("Error accessing microSD card!");
+            sd_card_present = false;
+            return false;
+        }
+        file_system = &SD_MMC;
+    } else {
+        // Set microSD Card CS as OUTPUT and set HIGH
+        pinMode(sd_cs_pin, OUTPUT);
+        digitalWrite(sd_cs_pin, HIGH);
+
+        // Initialize SPI bus for microSD Card
+        SPI.begin(spi_sck_pin, spi_miso_pin, spi_mosi_pin);
+
+        // Start microSD Card. Some cards and wiring can't keep up with a faster clock, so fall
+        // back to the library's default.
+        if (!SD.begin(sd_cs_pin, SPI, config.spi_frequency, SD_MOUNT_POINT,
+                      config.max_open_files)) {
+            if (config.spi_frequency <= SD_FALLBACK_SPI_FREQUENCY ||
+                !SD.begin(sd_cs_pin, SPI, SD_FALLBACK_SPI_FREQUENCY, SD_MOUNT_POINT,
+                          config.max_open_files)) {
+                Serial.println("Error accessing microSD card!");
+                sd_card_present = false;
+                return false;
+            }
+            Serial.printf("microSD card running at %u Hz\n", SD_FALLBACK_SPI_FREQUENCY);
+        }
+        file_system = &SD;
     }
 
+    YAudio::set_file_system(*file_system, SD_MOUNT_POINT);
     sd_card_present = true;
 
     return true;
 }
 
-bool YBoardV3::setup_display() {
-    if (!display.begin(SSD1306_SWITCHCAPVCC, 0x3c)) {
+fs::FS &YBoardV3::get_file_system() { return *file_system; }
+
+bool YBoardV3::test_sd_card_speed(sd_card_speed &result, size_t test_size_kb) {
+    if (!sd_card_present) {
+        Serial.println("ERROR: SD Card not present.");
+        return false;
+    }
+
+    size_t num_blocks = (test_size_kb * 1024 + SD_TEST_BLOCK_SIZE - 1) / SD_TEST_BLOCK_SIZE;
+    uint8_t *written = (uint8_t *)malloc(2 * SD_TEST_BLOCK_SIZE);
+    if (!written) {
+        Serial.println("Error allocating memory for SD card test.");
+        return false;
+    }
+    uint8_t *read_back = written + SD_TEST_BLOCK_SIZE;
+    for (size_t i = 0; i < SD_TEST_BLOCK_SIZE; i++) {
+        written[i] = (uint8_t)(i * 31 + (i >> 8));
+    }
+
+    bool ok = true;
+
+    // Closing the file flushes it, so that is included in the write time
+    File file = file_system->open(SD_TEST_FILE, FILE_WRITE);
+    uint32_t start = micros();
+    for (size_t i = 0; ok && i < num_blocks; i++) {
+        ok = file && file.write(written, SD_TEST_BLOCK_SIZE) == SD_TEST_BLOCK_SIZE;
+    }
+    file.close();
+    uint32_t write_us = micros() - start;
+
+    file = file_system->open(SD_TEST_FILE);
+    start = micros();
+    for (size_t i = 0; ok && i < num_blocks; i++) {
+        ok = file && file.read(read_back, SD_TEST_BLOCK_SIZE) == SD_TEST_BLOCK_SIZE &&
+             memcmp(written, read_back, SD_TEST_BLOCK_SIZE) == 0;
+    }
+    file.close();
+    uint32_t read_us = micros() - start;
+
+    file_system->remove(SD_TEST_FILE);
+    free(written);
+
+    if (!ok) {
+        Serial.println("Error testing SD card: the test file couldn't be written or read back.");
+        return false;
+    }
+
+    uint64_t test_bytes = (uint64_t)num_blocks * SD_TEST_BLOCK_SIZE;
+    result.write_kb_per_second = test_bytes * 1000000 / 1024 / max(write_us, (uint32_t)1);
+    result.read_kb_per_second = test_bytes * 1000000 / 1024 / max(read_us, (uint32_t)1);
+
+    return true;
+}
+
+////////////////////////////// Power /////////////////////////////////////////
+void YBoardV3::enable_low_power(const low_power_config &config) {
+    power_config = config;
+    low_power_enabled = true;
+    YAudio::set_power_save(config.audio_idle_ms);
+}
+
+bool YBoardV3::is_idle() {
+    // Anything still being set up in the background isn't idle
+    if (!low_power_enabled || !setup_events ||
+        (xEventGroupGetBits(setup_events) & SUBSYSTEM_ALL) != SUBSYSTEM_ALL) {
+        return false;
+    }
+
+    // The audio tasks power down the speaker and mic once nothing has played or been recorded
+    // for audio_idle_ms
+    if (!YAudio::is_powered_down()) {
+        return false;
+    }
+
+    return !YLeds::is_animating() && !(leds_async && YLeds::is_showing()) &&
+           !(is_ready(SUBSYSTEM_DISPLAY) && display.is_flushing());
+}
+
+bool YBoardV3::light_sleep(uint32_t timeout_ms) {
+    if (!is_idle()) {
+        return false;
+    }
+
+    // The I2C clock stops during sleep, so wait for the transaction in progress and hold the bus
+    bool bus_paused = YI2C::pause();
+
+    if (power_config.wake_on_buttons) {
+        YInputs::enable_wakeup(YInputs::INPUT_BUTTON_1);
+        YInputs::enable_wakeup(YInputs::INPUT_BUTTON_2);
+    }
+    if (power_config.wake_on_switches) {
+        YInputs::enable_wakeup(YInputs::INPUT_SWITCH_1);
+        YInputs::enable_wakeup(YInputs::INPUT_SWITCH_2);
+    }
+    if (power_config.wake_on_accelerometer && is_ready(SUBSYSTEM_ACCELEROMETER)) {
+        YAccel::enable_wakeup();
+    }
+    esp_sleep_enable_gpio_wakeup();
+    if (timeout_ms != UINT32_MAX) {
+        esp_sleep_enable_timer_wakeup((uint64_t)timeout_ms * 1000);
+    }
+
+    // Serial output stops during sleep, so send what has already been printed
+    Serial.flush();
+    bool slept = esp_light_sleep_start() == ESP_OK;
+
+    esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
+    YInputs::end_wakeup();
+    YAccel::end_wakeup();
+    if (bus_paused) {
+        YI2C::resume();
+    }
+
+    return slept;
+}
+
+bool YBoardV3::setup_display(const display_config &config) {
+    setup_i2c();
+
+    if (!display.begin(SSD1306_SWITCHCAPVCC, display_addr, config)) {
         Serial.println("Error initializing display");
         return false;
     }
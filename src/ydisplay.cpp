@@ -0,0 +1,240 @@
+#include "ydisplay.h"
+
+///////////////////////////////// Configuration Constants //////////////////////
+
+// The flush task runs on core 0, away from the Arduino loop on core 1
+static const BaseType_t DISPLAY_TASK_CORE = 0;
+static const UBaseType_t DISPLAY_TASK_PRIORITY = 1;
+static const uint32_t DISPLAY_TASK_STACK_SIZE = 2048;
+
+// YI2C transfers are at most 128 bytes, including the control byte at the start
+static const size_t MAX_DATA_BYTES = 127;
+static const size_t MAX_COMMAND_BYTES = 16;
+
+// SSD1306 control bytes
+static const uint8_t CONTROL_COMMANDS = 0x00;
+static const uint8_t CONTROL_DATA = 0x40;
+
+////////////////////////////// Public Functions ///////////////////////////////
+YDisplay::YDisplay(uint8_t w, uint8_t h, TwoWire *twi) : Adafruit_SSD1306(w, h, twi) {}
+
+YDisplay::~YDisplay() {
+    if (flush_task_handle) {
+        vTaskDelete(flush_task_handle);
+    }
+    free(sent_frame);
+}
+
+bool YDisplay::begin(uint8_t switchvcc, uint8_t i2caddr, const display_config &config) {
+    // The library sends its setup commands through Wire itself, so keep it at the bus clock, and
+    // hold the YI2C bus task off Wire while it does. The bus is already started by YBoardV3.
+    wireClk = restoreClk = wire->getClock();
+    if (!YI2C::pause()) {
+        return false;
+    }
+    bool started = Adafruit_SSD1306::begin(switchvcc, i2caddr, true, false);
+    YI2C::resume();
+    if (!started || !YI2C::add_device(i2caddr, config.i2c_clock, YI2C::PRIORITY_LOW)) {
+        return false;
+    }
+
+    frame_bytes = WIDTH * ((HEIGHT + 7) / 8);
+    sent_frame = (uint8_t *)calloc(3, frame_bytes);
+    if (!sent_frame) {
+        return false;
+    }
+    pending_frame = sent_frame + frame_bytes;
+    working_frame = pending_frame + frame_bytes;
+
+    if (config.async) {
+        xTaskCreatePinnedToCore(flush_task, "display_flush_task", DISPLAY_TASK_STACK_SIZE, this,
+                                DISPLAY_TASK_PRIORITY, &flush_task_handle, DISPLAY_TASK_CORE);
+    }
+
+    return true;
+}
+
+void YDisplay::display() {
+    if (!sent_frame) {
+        return;
+    }
+
+    if (!flush_task_handle) {
+        send_changes(buffer);
+        return;
+    }
+
+    // Copy the frame so drawing the next one can start while this one is sent
+    portENTER_CRITICAL(&frame_lock);
+    memcpy(pending_frame, buffer, frame_bytes);
+    frame_pending = true;
+    portEXIT_CRITICAL(&frame_lock);
+
+    xTaskNotifyGive(flush_task_handle);
+}
+
+bool YDisplay::is_flushing() { return frame_pending || flushing; }
+
+void YDisplay::wait_for_flush() {
+    while (is_flushing()) {
+        vTaskDelay(1);
+    }
+}
+
+void YDisplay::ssd1306_command(uint8_t c) { send_commands(&c, 1); }
+
+void YDisplay::invertDisplay(bool i) {
+    ssd1306_command(i ? SSD1306_INVERTDISPLAY : SSD1306_NORMALDISPLAY);
+}
+
+void YDisplay::dim(bool dim) {
+    const uint8_t commands[] = {SSD1306_SETCONTRAST, dim ? (uint8_t)0 : contrast};
+    send_commands(commands, sizeof(commands));
+}
+
+// The scroll commands are the same ones Adafruit_SSD1306 sends. The scroll covers pages start to
+// stop, and the display must not be drawn on while it is scrolling.
+void YDisplay::startscrollright(uint8_t start, uint8_t stop) {
+    const uint8_t commands[] = {SSD1306_RIGHT_HORIZONTAL_SCROLL, 0x00, start, 0x00, stop, 0x00,
+                                0xFF, SSD1306_ACTIVATE_SCROLL};
+    send_commands(commands, sizeof(commands));
+}
+
+void YDisplay::startscrollleft(uint8_t start, uint8_t stop) {
+    const uint8_t commands[] = {SSD1306_LEFT_HORIZONTAL_SCROLL, 0x00, start, 0x00, stop, 0x00,
+                                0xFF, SSD1306_ACTIVATE_SCROLL};
+    send_commands(commands, sizeof(commands));
+}
+
+void YDisplay::startscrolldiagright(uint8_t start, uint8_t stop) {
+    const uint8_t commands[] = {SSD1306_SET_VERTICAL_SCROLL_AREA,
+                                0x00,
+                                (uint8_t)HEIGHT,
+                                SSD1306_VERTICAL_AND_RIGHT_HORIZONTAL_SCROLL,
+                                0x00,
+                                start,
+                                0x00,
+                                stop,
+                                0x01,
+                                SSD1306_ACTIVATE_SCROLL};
+    send_commands(commands, sizeof(commands));
+}
+
+void YDisplay::startscrolldiagleft(uint8_t start, uint8_t stop) {
+    const uint8_t commands[] = {SSD1306_SET_VERTICAL_SCROLL_AREA,
+                                0x00,
+                                (uint8_t)HEIGHT,
+                                SSD1306_VERTICAL_AND_LEFT_HORIZONTAL_SCROLL,
+                                0x00,
+                                start,
+                                0x00,
+                                stop,
+                                0x01,
+                                SSD1306_ACTIVATE_SCROLL};
+    send_commands(commands, sizeof(commands));
+}
+
+void YDisplay::stopscroll() { ssd1306_command(SSD1306_DEACTIVATE_SCROLL); }
+
+////////////////////////////// Private Functions ///////////////////////////////
+
+void YDisplay::flush_task(void *params) {
+    YDisplay *display = (YDisplay *)params;
+
+    while (1) {
+        // Block waiting for a frame
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Frames that come in while one is being sent are merged, and only the newest is sent
+        while (display->take_pending_frame()) {
+            display->send_changes(display->working_frame);
+            display->flushing = false;
+        }
+    }
+}
+
+bool YDisplay::take_pending_frame() {
+    portENTER_CRITICAL(&frame_lock);
+    if (!frame_pending) {
+        portEXIT_CRITICAL(&frame_lock);
+        return false;
+    }
+    memcpy(working_frame, pending_frame, frame_bytes);
+    frame_pending = false;
+    flushing = true;
+    portEXIT_CRITICAL(&frame_lock);
+
+    return true;
+}
+
+// Compares each page (a row 8 pixels tall) with what the display already shows, and sends the
+// columns from the first to the last one that changed
+void YDisplay::send_changes(const uint8_t *frame) {
+    bool sent_ok = true;
+
+    for (int page = 0; page < (HEIGHT + 7) / 8; page++) {
+        const uint8_t *row = frame + page * WIDTH;
+        uint8_t *sent_row = sent_frame + page * WIDTH;
+
+        int first = 0;
+        int last = WIDTH - 1;
+        if (sent_valid) {
+            while (first < WIDTH && row[first] == sent_row[first]) {
+                first++;
+            }
+            if (first == WIDTH) {
+                continue;
+            }
+            while (row[last] == sent_row[last]) {
+                last--;
+            }
+        }
+
+        if (!send_window(page, first, last, row + first)) {
+            sent_ok = false;
+            break;
+        }
+        memcpy(sent_row + first, row + first, last - first + 1);
+    }
+
+    // If a transfer failed, the display may not match sent_frame, so send everything next time
+    sent_valid = sent_ok;
+}
+
+bool YDisplay::send_window(uint8_t page, uint8_t first_column, uint8_t last_column,
+                           const uint8_t *data) {
+    const uint8_t commands[] = {CONTROL_COMMANDS,   SSD1306_PAGEADDR, page,       page,
+                                SSD1306_COLUMNADDR, first_column,     last_column};
+    if (!YI2C::write(i2caddr, commands, sizeof(commands))) {
+        return false;
+    }
+
+    // The display moves to the next column after each byte. Each transaction is separate, so
+    // sensor reads can go in between.
+    uint8_t transfer[MAX_DATA_BYTES + 1];
+    transfer[0] = CONTROL_DATA;
+    size_t remaining = last_column - first_column + 1;
+    while (remaining > 0) {
+        size_t count = min(remaining, MAX_DATA_BYTES);
+        memcpy(transfer + 1, data, count);
+        if (!YI2C::write(i2caddr, transfer, count + 1)) {
+            return false;
+        }
+        data += count;
+        remaining -= count;
+    }
+
+    return true;
+}
+
+// Sends the commands in one transaction, after the control byte that marks them as commands
+bool YDisplay::send_commands(const uint8_t *commands, size_t count) {
+    if (count > MAX_COMMAND_BYTES) {
+        return false;
+    }
+
+    uint8_t transfer[MAX_COMMAND_BYTES + 1];
+    transfer[0] = CONTROL_COMMANDS;
+    memcpy(transfer + 1, commands, count);
+    return YI2C::write(i2caddr, transfer, count + 1);
+}
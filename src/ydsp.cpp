@@ -0,0 +1,167 @@
+#include "ydsp.h"
+
+#include <string.h>
+
+// esp-dsp comes with the ESP32 Arduino core. Its S3 add uses the PIE vector unit, which saturates
+// like the scalar versions do.
+#if __has_include(<dsps_add.h>) && __has_include(<dsps_mulc.h>)
+#include <dsps_add.h>
+#include <dsps_mulc.h>
+#endif
+
+#if defined(dsps_add_s16_aes3_enabled) && dsps_add_s16_aes3_enabled
+#define YDSP_VECTOR 1
+#else
+#define YDSP_VECTOR 0
+#endif
+
+namespace YDSP {
+
+///////////////////////////////// Configuration Constants //////////////////////
+
+// Pole of the DC removal filter (0.995 in Q15), which puts its cutoff around 35 Hz at 44.1 kHz
+static const int32_t DC_FILTER_POLE = 32604;
+
+#if YDSP_VECTOR
+// The vector add needs 16-byte aligned buffers and a multiple of 8 samples, so the input is
+// copied into an aligned buffer on the stack this many samples at a time
+static const size_t VECTOR_CHUNK = 64;
+static const size_t VECTOR_LANES = 8;
+
+////////////////////////////// Vector Functions ///////////////////////////////
+
+static bool is_vector_aligned(const int16_t *samples) { return ((uintptr_t)samples & 15) == 0; }
+
+// out = saturate(a + b) for a multiple of VECTOR_LANES samples
+static void add_vector(int16_t *out, const int16_t *a, const int16_t *b, size_t num_samples) {
+    dsps_add_s16_aes3(a, b, out, num_samples, 1, 1, 1, 0);
+}
+
+// Returns the number of samples done, and leaves the rest for the scalar loop
+static size_t apply_gain_vector(int16_t *samples, size_t num_samples, int32_t gain_q8) {
+    if (!is_vector_aligned(samples) || gain_q8 < 0) {
+        return 0;
+    }
+    size_t vector_samples = num_samples - num_samples % VECTOR_LANES;
+
+    // Attenuation is a single multiply, and doesn't need saturation
+    if (gain_q8 < Q8_ONE) {
+        dsps_mulc_s16(samples, samples, vector_samples, gain_q8 << 7, 1, 1);
+        return vector_samples;
+    }
+
+    // Whole-number boosts are built up from saturating adds, doubling for each bit of the gain.
+    // Every term has the same sign, so saturating along the way gives the same result as
+    // saturating the full product once.
+    if (gain_q8 % Q8_ONE != 0) {
+        return 0;
+    }
+    int32_t gain = gain_q8 / Q8_ONE;
+    int top_bit = 31 - __builtin_clz(gain);
+    alignas(16) int16_t input[VECTOR_CHUNK];
+    for (size_t start = 0; start < vector_samples; start += VECTOR_CHUNK) {
+        int16_t *chunk = samples + start;
+        size_t n = vector_samples - start < VECTOR_CHUNK ? vector_samples - start : VECTOR_CHUNK;
+        memcpy(input, chunk, n * sizeof(int16_t));
+        for (int bit = top_bit - 1; bit >= 0; bit--) {
+            add_vector(chunk, chunk, chunk, n);
+            if (gain & (1 << bit)) {
+                add_vector(chunk, chunk, input, n);
+            }
+        }
+    }
+    return vector_samples;
+}
+
+static size_t mix_vector(int16_t *mix, const int16_t *samples, size_t num_samples,
+                         int32_t gain_q15) {
+    if (!is_vector_aligned(mix) || gain_q15 < 0 || gain_q15 > Q15_ONE) {
+        return 0;
+    }
+    size_t vector_samples = num_samples - num_samples % VECTOR_LANES;
+
+    alignas(16) int16_t scaled[VECTOR_CHUNK];
+    for (size_t start = 0; start < vector_samples; start += VECTOR_CHUNK) {
+        size_t n = vector_samples - start < VECTOR_CHUNK ? vector_samples - start : VECTOR_CHUNK;
+        const int16_t *input = samples + start;
+        if (gain_q15 < Q15_ONE) {
+            dsps_mulc_s16(input, scaled, n, gain_q15, 1, 1);
+            input = scaled;
+        } else if (!is_vector_aligned(input)) {
+            memcpy(scaled, input, n * sizeof(int16_t));
+            input = scaled;
+        }
+        add_vector(mix + start, mix + start, input, n);
+    }
+    return vector_samples;
+}
+#endif
+
+////////////////////////////// Public Functions ///////////////////////////////
+
+// All of these work on whole blocks with 32-bit intermediates and saturate back to 16 bits, so
+// loud audio clips instead of wrapping around
+
+void apply_gain_scalar(int16_t *samples, size_t num_samples, int32_t gain_q8) {
+    for (size_t i = 0; i < num_samples; i++) {
+        samples[i] = saturate((samples[i] * gain_q8) >> 8);
+    }
+}
+
+void mix_scalar(int16_t *mix, const int16_t *samples, size_t num_samples, int32_t gain_q15) {
+    for (size_t i = 0; i < num_samples; i++) {
+        mix[i] = saturate(mix[i] + ((samples[i] * gain_q15) >> 15));
+    }
+}
+
+void apply_gain(int16_t *samples, size_t num_samples, int32_t gain_q8) {
+    if (gain_q8 == Q8_ONE) {
+        return;
+    }
+    size_t done = 0;
+#if YDSP_VECTOR
+    done = apply_gain_vector(samples, num_samples, gain_q8);
+#endif
+    apply_gain_scalar(samples + done, num_samples - done, gain_q8);
+}
+
+void mix(int16_t *mix, const int16_t *samples, size_t num_samples, int32_t gain_q15) {
+    if (gain_q15 == 0) {
+        return;
+    }
+    size_t done = 0;
+#if YDSP_VECTOR
+    done = mix_vector(mix, samples, num_samples, gain_q15);
+#endif
+    mix_scalar(mix + done, samples + done, num_samples - done, gain_q15);
+}
+
+void fade(int16_t *samples, size_t num_samples, int32_t start_gain_q15, int32_t end_gain_q15) {
+    if (num_samples == 0) {
+        return;
+    }
+
+    // Step the gain with 15 extra bits, so the ramp stays smooth over long fades
+    int32_t gain = start_gain_q15 << 15;
+    int32_t step = ((end_gain_q15 - start_gain_q15) << 15) / (int32_t)num_samples;
+    for (size_t i = 0; i < num_samples; i++) {
+        samples[i] = saturate((samples[i] * (gain >> 15)) >> 15);
+        gain += step;
+    }
+}
+
+void remove_dc(int16_t *samples, size_t num_samples, dc_filter_state &state) {
+    // One-pole high-pass filter: y[n] = x[n] - x[n-1] + pole * y[n-1]. The output is saturated
+    // before it is fed back, which keeps the multiply from overflowing.
+    int32_t x1 = state.previous_input;
+    int32_t y1 = state.previous_output;
+    for (size_t i = 0; i < num_samples; i++) {
+        int32_t x = samples[i];
+        y1 = saturate(x - x1 + ((DC_FILTER_POLE * y1) >> 15));
+        x1 = x;
+        samples[i] = y1;
+    }
+    state.previous_input = x1;
+    state.previous_output = y1;
+}
+}; // namespace YDSP
@@ -0,0 +1,257 @@
+#include "yi2c.h"
+
+#include <Arduino.h>
+
+namespace YI2C {
+
+///////////////////////////////// Configuration Constants //////////////////////
+
+// The bus task runs above the tasks that use the bus, so a transaction starts as soon as it is
+// queued
+static const BaseType_t BUS_TASK_CORE = 0;
+static const UBaseType_t BUS_TASK_PRIORITY = 3;
+static const uint32_t BUS_TASK_STACK_SIZE = 2048;
+
+static const int MAX_DEVICES = 8;
+
+// The Wire buffer holds 128 bytes, so longer transfers have to be split by the caller
+static const size_t MAX_TRANSFER_BYTES = 128;
+
+struct device_t {
+    uint8_t address;
+    uint32_t clock;
+    transaction_priority priority;
+    SemaphoreHandle_t lock; // Held by the task with a transaction in progress for this device
+    SemaphoreHandle_t done; // Given by the bus task when the transaction is finished
+    device_stats stats;
+};
+
+struct transaction_t {
+    device_t *device;
+    const uint8_t *tx_data;
+    size_t tx_length;
+    uint8_t *rx_data;
+    size_t rx_length;
+    uint32_t queued_at;
+    bool *ok;
+};
+
+// Only the bus task uses Wire once it is set up
+static TwoWire *bus = NULL;
+static uint32_t bus_clock;
+static TaskHandle_t bus_task_handle;
+
+static device_t devices[MAX_DEVICES];
+static int num_devices = 0;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// One queue for each priority. Each device has at most one transaction waiting, plus a pause, so
+// with a queue one longer than the number of devices, sending never blocks.
+static const int QUEUE_LENGTH = MAX_DEVICES + 1;
+static QueueHandle_t queues[2];
+static SemaphoreHandle_t queued_transactions;
+
+// A pause is queued as a transaction with no device. The bus task gives bus_paused when it gets
+// to it, and then waits for bus_resumed.
+static SemaphoreHandle_t bus_paused;
+static SemaphoreHandle_t bus_resumed;
+
+//////////////////////////// Private Function Prototypes ///////////////////////
+static device_t *find_device(uint8_t address);
+static bool run(uint8_t address, const uint8_t *tx_data, size_t tx_length, uint8_t *rx_data,
+                size_t rx_length);
+static void bus_task(void *params);
+static bool perform_transaction(const transaction_t &transaction);
+
+////////////////////////////// Public Functions ///////////////////////////////
+bool setup(TwoWire &wire, int sda, int scl, uint32_t frequency) {
+    if (bus) {
+        return true;
+    }
+
+    if (!wire.begin(sda, scl, frequency)) {
+        return false;
+    }
+    bus_clock = frequency;
+
+    queues[PRIORITY_HIGH] = xQueueCreate(QUEUE_LENGTH, sizeof(transaction_t));
+    queues[PRIORITY_LOW] = xQueueCreate(QUEUE_LENGTH, sizeof(transaction_t));
+    queued_transactions = xSemaphoreCreateCounting(2 * QUEUE_LENGTH, 0);
+    bus_paused = xSemaphoreCreateBinary();
+    bus_resumed = xSemaphoreCreateBinary();
+    if (!queues[PRIORITY_HIGH] || !queues[PRIORITY_LOW] || !queued_transactions || !bus_paused ||
+        !bus_resumed) {
+        return false;
+    }
+
+    if (xTaskCreatePinnedToCore(bus_task, "i2c_bus_task", BUS_TASK_STACK_SIZE, NULL,
+                                BUS_TASK_PRIORITY, &bus_task_handle, BUS_TASK_CORE) != pdPASS) {
+        return false;
+    }
+
+    bus = &wire;
+    return true;
+}
+
+bool add_device(uint8_t address, uint32_t clock, transaction_priority priority) {
+    if (find_device(address)) {
+        return true;
+    }
+    if (num_devices == MAX_DEVICES) {
+        return false;
+    }
+
+    device_t *device = &devices[num_devices];
+    device->address = address;
+    device->clock = clock;
+    device->priority = priority;
+    device->lock = xSemaphoreCreateMutex();
+    device->done = xSemaphoreCreateBinary();
+    device->stats = {};
+    if (!device->lock || !device->done) {
+        return false;
+    }
+
+    num_devices++;
+    return true;
+}
+
+bool write(uint8_t address, const uint8_t *data, size_t length) {
+    return run(address, data, length, NULL, 0);
+}
+
+bool write_read(uint8_t address, const uint8_t *tx_data, size_t tx_length, uint8_t *rx_data,
+                size_t rx_length) {
+    return run(address, tx_data, tx_length, rx_data, rx_length);
+}
+
+bool get_stats(uint8_t address, device_stats &stats) {
+    device_t *device = find_device(address);
+    if (!device) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&stats_lock);
+    stats = device->stats;
+    portEXIT_CRITICAL(&stats_lock);
+
+    return true;
+}
+
+bool pause() {
+    if (!bus) {
+        return false;
+    }
+
+    // High priority, so the bus is paused after at most one more transaction
+    transaction_t transaction = {};
+    xQueueSend(queues[PRIORITY_HIGH], &transaction, portMAX_DELAY);
+    xSemaphoreGive(queued_transactions);
+    xSemaphoreTake(bus_paused, portMAX_DELAY);
+
+    return true;
+}
+
+void resume() {
+    if (bus) {
+        xSemaphoreGive(bus_resumed);
+    }
+}
+
+////////////////////////////// Private Functions ///////////////////////////////
+
+device_t *find_device(uint8_t address) {
+    for (int i = 0; i < num_devices; i++) {
+        if (devices[i].address == address) {
+            return &devices[i];
+        }
+    }
+    return NULL;
+}
+
+// Queues the transaction for the bus task and waits for it to finish
+bool run(uint8_t address, const uint8_t *tx_data, size_t tx_length, uint8_t *rx_data,
+         size_t rx_length) {
+    device_t *device = find_device(address);
+    if (!bus || !device || tx_length > MAX_TRANSFER_BYTES || rx_length > MAX_TRANSFER_BYTES) {
+        return false;
+    }
+
+    xSemaphoreTake(device->lock, portMAX_DELAY);
+
+    bool ok = false;
+    transaction_t transaction = {device,    tx_data,            tx_length, rx_data,
+                                 rx_length, (uint32_t)micros(), &ok};
+    xQueueSend(queues[device->priority], &transaction, portMAX_DELAY);
+    xSemaphoreGive(queued_transactions);
+    xSemaphoreTake(device->done, portMAX_DELAY);
+    xSemaphoreGive(device->lock);
+
+    return ok;
+}
+
+void bus_task(void *params) {
+    transaction_t transaction;
+
+    while (1) {
+        xSemaphoreTake(queued_transactions, portMAX_DELAY);
+
+        // High priority transactions go first, so a sensor read waits for at most one
+        // transaction from a low priority device
+        if (xQueueReceive(queues[PRIORITY_HIGH], &transaction, 0) != pdTRUE &&
+            xQueueReceive(queues[PRIORITY_LOW], &transaction, 0) != pdTRUE) {
+            continue;
+        }
+
+        if (!transaction.device) {
+            xSemaphoreGive(bus_paused);
+            xSemaphoreTake(bus_resumed, portMAX_DELAY);
+            continue;
+        }
+
+        *transaction.ok = perform_transaction(transaction);
+        xSemaphoreGive(transaction.device->done);
+    }
+}
+
+bool perform_transaction(const transaction_t &transaction) {
+    device_t *device = transaction.device;
+    uint32_t start = micros();
+
+    if (device->clock != bus_clock) {
+        bus->setClock(device->clock);
+        bus_clock = device->clock;
+    }
+
+    // Reads are sent with a repeated start after the write, so nothing can come in between
+    bus->beginTransmission(device->address);
+    bus->write(transaction.tx_data, transaction.tx_length);
+    bool ok;
+    if (transaction.rx_length == 0) {
+        ok = bus->endTransmission() == 0;
+    } else {
+        ok = bus->endTransmission(false) == 0 &&
+             bus->requestFrom(device->address, (uint8_t)transaction.rx_length) ==
+                 transaction.rx_length;
+        for (size_t i = 0; ok && i < transaction.rx_length; i++) {
+            transaction.rx_data[i] = bus->read();
+        }
+    }
+
+    uint32_t end = micros();
+    uint32_t wait = start - transaction.queued_at;
+    uint32_t busy = end - start;
+
+    portENTER_CRITICAL(&stats_lock);
+    device->stats.transactions++;
+    if (!ok) {
+        device->stats.errors++;
+    }
+    device->stats.bus_time_us += busy;
+    device->stats.max_wait_us = max(device->stats.max_wait_us, wait);
+    device->stats.max_busy_us = max(device->stats.max_busy_us, busy);
+    portEXIT_CRITICAL(&stats_lock);
+
+    return ok;
+}
+}; // namespace YI2C
@@ -0,0 +1,356 @@
+#include "yinputs.h"
+
+#include <Arduino.h>
+#include <atomic>
+#include <driver/gpio.h>
+#include <hal/gpio_ll.h>
+
+namespace YInputs {
+
+///////////////////////////////// Configuration Constants //////////////////////
+
+// How long an input has to settle before a change counts, and how long a button has to be held
+// for a long press
+static const uint32_t DEBOUNCE_MS = 20;
+static const uint32_t LONG_PRESS_MS = 1000;
+
+// Number of events that can be waiting for poll_event
+static const int MAX_INPUT_EVENTS = 16;
+
+// The knob is read in the background. Each sample is the average of several readings, and the
+// samples are smoothed by a low-pass filter that moves 1/2^KNOB_FILTER_SHIFT of the way to each
+// new sample.
+static const uint32_t KNOB_SAMPLE_PERIOD_MS = 5;
+static const int KNOB_OVERSAMPLING = 8;
+static const int KNOB_FILTER_SHIFT = 3;
+
+// The knob task runs on core 0, away from the Arduino loop on core 1
+static const BaseType_t KNOB_TASK_CORE = 0;
+static const UBaseType_t KNOB_TASK_PRIORITY = 1;
+
+typedef struct {
+    input_id id;
+    int pin;
+    bool active_low;
+    bool active;        // Debounced state
+    bool bouncing;      // Set from the first edge until the input settles
+    uint32_t edge_time; // millis() of the first edge
+    bool wakeup;        // Set while the pin is set up to wake the board instead of interrupting
+    TimerHandle_t debounce_timer;
+    TimerHandle_t long_press_timer;
+} input_t;
+
+// The first edge on an input's pin turns its interrupt off and starts its debounce timer, which
+// reads the settled pin and turns the interrupt back on, so a bouncing contact only sends the
+// timer task one command. The timers run in the FreeRTOS timer task, which reports the events.
+// Waking from light sleep also turns the interrupts off and on, so that is done under pin_lock.
+static input_t inputs[NUM_INPUTS];
+static portMUX_TYPE pin_lock = portMUX_INITIALIZER_UNLOCKED;
+static QueueHandle_t input_events;
+static input_event_callback event_callback = NULL;
+static void *event_callback_arg = NULL;
+static portMUX_TYPE event_callback_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Knob sampling. The filter keeps 8 fractional bits, so small changes still add up. The task
+// keeps the latest position (0-100) for get_knob, and calls the callback when the position has
+// moved by at least the threshold since the last call.
+static TaskHandle_t knob_task_handle = NULL;
+static int knob_pin;
+static int knob_reading_at_0;
+static int knob_reading_at_100;
+static int32_t knob_filter = 0;
+static std::atomic<int> knob_value(0);
+static knob_callback knob_changed = NULL;
+static void *knob_changed_arg = NULL;
+static int knob_threshold = 1;
+static int knob_reported_value = 0;
+static portMUX_TYPE knob_callback_lock = portMUX_INITIALIZER_UNLOCKED;
+
+//////////////////////////// Private Function Prototypes ///////////////////////
+static void IRAM_ATTR input_isr(void *arg);
+static void debounce_timer_callback(TimerHandle_t timer);
+static void long_press_timer_callback(TimerHandle_t timer);
+static void report_event(const input_t &input, input_event_type type, uint32_t timestamp);
+static bool read_input(const input_t &input);
+static void start_debounce(input_t &input);
+static void knob_task(void *params);
+static int read_knob();
+static int knob_position(int32_t filter);
+
+////////////////////////////// Public Functions ///////////////////////////////
+bool setup_input(input_id id, int pin, bool active_low, bool long_press) {
+    if (!input_events) {
+        input_events = xQueueCreate(MAX_INPUT_EVENTS, sizeof(input_event));
+        if (!input_events) {
+            return false;
+        }
+    }
+
+    // Setting up again keeps the timers and interrupt from the first time, which the ISR uses
+    input_t &input = inputs[id];
+    if (input.debounce_timer) {
+        return true;
+    }
+
+    input.id = id;
+    input.pin = pin;
+    input.active_low = active_low;
+    input.active = read_input(input);
+    input.bouncing = false;
+    input.debounce_timer = xTimerCreate("debounce", pdMS_TO_TICKS(DEBOUNCE_MS), pdFALSE, &input,
+                                        debounce_timer_callback);
+    if (!input.debounce_timer) {
+        return false;
+    }
+    if (long_press) {
+        input.long_press_timer = xTimerCreate("long_press", pdMS_TO_TICKS(LONG_PRESS_MS), pdFALSE,
+                                              &input, long_press_timer_callback);
+        if (!input.long_press_timer) {
+            return false;
+        }
+    }
+
+    attachInterruptArg(pin, input_isr, &input, CHANGE);
+    return true;
+}
+
+bool poll_event(input_event &event) {
+    return input_events && xQueueReceive(input_events, &event, 0) == pdTRUE;
+}
+
+void set_event_callback(input_event_callback callback, void *arg) {
+    portENTER_CRITICAL(&event_callback_lock);
+    event_callback = callback;
+    event_callback_arg = arg;
+    portEXIT_CRITICAL(&event_callback_lock);
+}
+
+bool setup_knob(int pin, int reading_at_0, int reading_at_100) {
+    // Setting up again keeps sampling with the task from the first time
+    if (knob_task_handle) {
+        return true;
+    }
+
+    knob_pin = pin;
+    knob_reading_at_0 = reading_at_0;
+    knob_reading_at_100 = reading_at_100;
+
+    // Start the filter at the current position, so get_knob is right straight away
+    knob_filter = read_knob() << 8;
+    knob_value = knob_position(knob_filter);
+    knob_reported_value = knob_value;
+
+    return xTaskCreatePinnedToCore(knob_task, "knob_task", 2048, NULL, KNOB_TASK_PRIORITY,
+                                   &knob_task_handle, KNOB_TASK_CORE) == pdPASS;
+}
+
+int get_knob() { return knob_value.load(std::memory_order_relaxed); }
+
+void set_knob_callback(knob_callback callback, int threshold, void *arg) {
+    portENTER_CRITICAL(&knob_callback_lock);
+    knob_changed = callback;
+    knob_changed_arg = arg;
+    knob_threshold = max(threshold, 1);
+    knob_reported_value = knob_value;
+    portEXIT_CRITICAL(&knob_callback_lock);
+}
+
+bool enable_wakeup(input_id id) {
+    input_t &input = inputs[id];
+    if (!input.debounce_timer) {
+        return false;
+    }
+
+    // Waking is level triggered, and replaces the pin's interrupt type, so the edge interrupt is
+    // turned off until end_wakeup
+    gpio_num_t pin = (gpio_num_t)input.pin;
+    gpio_int_type_t level = digitalRead(input.pin) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL;
+    portENTER_CRITICAL(&pin_lock);
+    gpio_intr_disable(pin);
+    input.wakeup = true;
+    portEXIT_CRITICAL(&pin_lock);
+
+    if (gpio_wakeup_enable(pin, level) != ESP_OK) {
+        portENTER_CRITICAL(&pin_lock);
+        input.wakeup = false;
+        if (!input.bouncing) {
+            gpio_intr_enable(pin);
+        }
+        portEXIT_CRITICAL(&pin_lock);
+        return false;
+    }
+
+    return true;
+}
+
+void end_wakeup() {
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        input_t &input = inputs[i];
+        if (!input.wakeup) {
+            continue;
+        }
+
+        gpio_num_t pin = (gpio_num_t)input.pin;
+        gpio_wakeup_disable(pin);
+        gpio_set_intr_type(pin, GPIO_INTR_ANYEDGE);
+
+        // The edge that woke the board didn't interrupt, so debounce it as if it had. Either way,
+        // if a debounce is running, its timer turns the interrupt back on.
+        portENTER_CRITICAL(&pin_lock);
+        input.wakeup = false;
+        bool debouncing = input.bouncing || read_input(input) != input.active;
+        if (!debouncing) {
+            gpio_intr_enable(pin);
+        }
+        portEXIT_CRITICAL(&pin_lock);
+
+        if (debouncing) {
+            start_debounce(input);
+        }
+    }
+}
+
+////////////////////////////// Private Functions ///////////////////////////////
+
+void IRAM_ATTR input_isr(void *arg) {
+    input_t *input = (input_t *)arg;
+
+    BaseType_t woken = pdFALSE;
+
+    portENTER_CRITICAL_ISR(&pin_lock);
+    bool was_bouncing = input->bouncing;
+    if (!was_bouncing) {
+        input->bouncing = true;
+        input->edge_time = millis();
+    }
+
+    // The rest of the bounces are ignored until the debounce timer turns the interrupt back on. If
+    // the timer task's queue is full, the interrupt stays on and the next edge tries again. The
+    // GPIO driver functions are in flash, so the interrupt is turned off through the HAL, which is
+    // inlined into this IRAM function.
+    if (xTimerResetFromISR(input->debounce_timer, &woken) == pdPASS) {
+        gpio_ll_intr_disable(&GPIO, (gpio_num_t)input->pin);
+    } else {
+        input->bouncing = was_bouncing;
+    }
+    portEXIT_CRITICAL_ISR(&pin_lock);
+
+    portYIELD_FROM_ISR(woken);
+}
+
+void debounce_timer_callback(TimerHandle_t timer) {
+    input_t &input = *(input_t *)pvTimerGetTimerID(timer);
+    gpio_num_t pin = (gpio_num_t)input.pin;
+    uint32_t edge_time = input.edge_time;
+    bool active = read_input(input);
+
+    // Listen for the next edge, unless the pin is waiting to wake the board instead. A change
+    // since the pin was read had no interrupt to catch it, so that is debounced as well.
+    portENTER_CRITICAL(&pin_lock);
+    input.bouncing = false;
+    bool changed_again = false;
+    if (!input.wakeup) {
+        gpio_intr_enable(pin);
+        changed_again = read_input(input) != active;
+        if (changed_again) {
+            gpio_intr_disable(pin);
+        }
+    }
+    portEXIT_CRITICAL(&pin_lock);
+    if (changed_again) {
+        start_debounce(input);
+    }
+
+    // A bounce that ends up back where it started isn't a change
+    if (active == input.active) {
+        return;
+    }
+    input.active = active;
+
+    report_event(input, active ? INPUT_PRESSED : INPUT_RELEASED, edge_time);
+
+    if (input.long_press_timer) {
+        if (active) {
+            xTimerReset(input.long_press_timer, 0);
+        } else {
+            xTimerStop(input.long_press_timer, 0);
+        }
+    }
+}
+
+void long_press_timer_callback(TimerHandle_t timer) {
+    input_t &input = *(input_t *)pvTimerGetTimerID(timer);
+    if (input.active) {
+        report_event(input, INPUT_LONG_PRESS, millis());
+    }
+}
+
+// Passes the event to the callback if there is one, and otherwise queues it for poll_event. If
+// the queue is full, the event is dropped.
+void report_event(const input_t &input, input_event_type type, uint32_t timestamp) {
+    input_event event = {input.id, type, timestamp};
+
+    portENTER_CRITICAL(&event_callback_lock);
+    input_event_callback callback = event_callback;
+    void *callback_arg = event_callback_arg;
+    portEXIT_CRITICAL(&event_callback_lock);
+
+    if (callback) {
+        callback(event, callback_arg);
+    } else {
+        xQueueSend(input_events, &event, 0);
+    }
+}
+
+bool read_input(const input_t &input) { return digitalRead(input.pin) != input.active_low; }
+
+// Like input_isr, for inputs that changed while their interrupt was off. The interrupt has to
+// already be off.
+void start_debounce(input_t &input) {
+    if (!input.bouncing) {
+        input.bouncing = true;
+        input.edge_time = millis();
+    }
+    xTimerReset(input.debounce_timer, 0);
+}
+
+void knob_task(void *params) {
+    TickType_t last_wake = xTaskGetTickCount();
+    while (1) {
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(KNOB_SAMPLE_PERIOD_MS));
+
+        knob_filter += ((read_knob() << 8) - knob_filter) >> KNOB_FILTER_SHIFT;
+        int value = knob_position(knob_filter);
+        knob_value.store(value, std::memory_order_relaxed);
+
+        portENTER_CRITICAL(&knob_callback_lock);
+        knob_callback callback = knob_changed;
+        void *callback_arg = knob_changed_arg;
+        bool changed = abs(value - knob_reported_value) >= knob_threshold;
+        if (callback && changed) {
+            knob_reported_value = value;
+        }
+        portEXIT_CRITICAL(&knob_callback_lock);
+
+        if (callback && changed) {
+            callback(value, callback_arg);
+        }
+    }
+}
+
+int read_knob() {
+    int sum = 0;
+    for (int i = 0; i < KNOB_OVERSAMPLING; i++) {
+        sum += analogRead(knob_pin);
+    }
+    return sum / KNOB_OVERSAMPLING;
+}
+
+// Converts a filtered reading to a position between 0 and 100
+int knob_position(int32_t filter) {
+    int value = map(filter >> 8, knob_reading_at_0, knob_reading_at_100, 0, 100);
+    value = max(0, value);
+    value = min(100, value);
+    return value;
+}
+}; // namespace YInputs
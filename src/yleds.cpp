@@ -0,0 +1,446 @@
+#include "yleds.h"
+
+#include <Arduino.h>
+#include <esp_idf_version.h>
+
+#if ESP_IDF_VERSION_MAJOR < 5
+#include <driver/rmt.h>
+#include <esp_timer.h>
+#endif
+
+namespace YLeds {
+
+#if ESP_IDF_VERSION_MAJOR < 5
+
+///////////////////////////////// Configuration Constants //////////////////////
+
+// Adafruit_NeoPixel allocates RMT channels starting from 0, so use the last TX channel
+static const rmt_channel_t LED_RMT_CHANNEL = RMT_CHANNEL_3;
+
+// The RMT clock is the 80 MHz APB clock divided by 2, so each tick is 25 ns
+static const uint8_t LED_RMT_CLK_DIV = 2;
+static const uint32_t T0H_TICKS = 16; // 0.40 us
+static const uint32_t T0L_TICKS = 34; // 0.85 us
+static const uint32_t T1H_TICKS = 32; // 0.80 us
+static const uint32_t T1L_TICKS = 18; // 0.45 us
+
+// The output task runs on core 0, away from the Arduino loop on core 1
+static const BaseType_t LED_TASK_CORE = 0;
+static const UBaseType_t LED_TASK_PRIORITY = 2;
+
+// Animation colors are corrected for the LEDs looking brighter at low levels than they are
+static const float LED_GAMMA = 2.6;
+
+// Colors around the color wheel for the rainbow. Each of the 6 sections fades one of red, green
+// and blue in or out over 256 steps.
+static const int HUE_STEPS = 6 * 256;
+
+// Frame buffers. One is being clocked out while the other is filled by show_async.
+static uint8_t *frame_buffers[2];
+static size_t frame_bytes;
+static int back_buffer = 0;
+static bool frame_pending = false;
+static bool transmitting = false;
+static portMUX_TYPE frame_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Output task
+static TaskHandle_t led_output_task_handle;
+static SemaphoreHandle_t driver_setup_done;
+static bool driver_ready = false;
+
+// Animations. The timer callback copies the base frame, which is the last frame from show_async,
+// draws the animations over it, and queues it like show_async does. Everything but the frame it
+// draws into is shared with the other tasks, under animation_lock. The timer is only started and
+// stopped under the lock too. Once the last animation is stopped, the next tick sends the base
+// frame on its own and stops the timer, so no tick can send an animation frame after it.
+typedef struct {
+    animation settings;
+    bool active;
+    uint32_t start_ms;
+} animation_slot_t;
+
+static uint8_t *base_frame;
+static uint8_t *animation_frame;
+static animation_slot_t animations[MAX_ANIMATIONS];
+static uint32_t brightness_scale = 256; // Out of 256, like Adafruit_NeoPixel's brightness
+static uint8_t gamma_table[256];
+static esp_timer_handle_t animation_timer = NULL;
+static bool timer_running = false;
+static uint64_t frame_period_us;
+static portMUX_TYPE animation_lock = portMUX_INITIALIZER_UNLOCKED;
+
+//////////////////////////// Private Function Prototypes ///////////////////////
+static void queue_frame(const uint8_t *pixels);
+static void stage_frame(const uint8_t *pixels);
+static void led_output_task(void *params);
+static void animation_timer_callback(void *arg);
+static void draw_animation(const animation_slot_t &slot, uint32_t now_ms);
+static void keyframe_color(const animation &animation, int64_t time_ms, uint8_t *rgb);
+static void hue_color(uint32_t hue, uint8_t *rgb);
+static uint8_t interpolate(uint8_t from, uint8_t to, uint32_t fraction);
+static uint32_t now_ms();
+static void IRAM_ATTR ws2812_translator(const void *src, rmt_item32_t *dest, size_t src_size,
+                                        size_t wanted_num, size_t *translated_size,
+                                        size_t *item_num);
+
+////////////////////////////// Public Functions ///////////////////////////////
+bool setup_async_output(int pin, size_t num_bytes) {
+    if (driver_ready) {
+        return true;
+    }
+
+    frame_bytes = num_bytes;
+    frame_buffers[0] = (uint8_t *)calloc(4, num_bytes);
+    if (!frame_buffers[0]) {
+        return false;
+    }
+    frame_buffers[1] = frame_buffers[0] + num_bytes;
+    base_frame = frame_buffers[1] + num_bytes;
+    animation_frame = base_frame + num_bytes;
+
+    // The RMT interrupt runs on the core that installs the driver, so the driver is installed
+    // from the output task itself
+    driver_setup_done = xSemaphoreCreateBinary();
+    xTaskCreatePinnedToCore(led_output_task, "led_output_task", 2048, (void *)(intptr_t)pin,
+                            LED_TASK_PRIORITY, &led_output_task_handle, LED_TASK_CORE);
+    xSemaphoreTake(driver_setup_done, portMAX_DELAY);
+
+    return driver_ready;
+}
+
+void show_async(const uint8_t *pixels) {
+    // Keep the frame for animations to be drawn over. While they are playing, the next tick
+    // sends it.
+    portENTER_CRITICAL(&animation_lock);
+    memcpy(base_frame, pixels, frame_bytes);
+    bool animating = timer_running;
+    portEXIT_CRITICAL(&animation_lock);
+
+    if (!animating) {
+        queue_frame(pixels);
+    }
+}
+
+bool is_showing() { return frame_pending || transmitting; }
+
+bool setup_animations(int frame_rate) {
+    if (!driver_ready || frame_rate <= 0) {
+        return false;
+    }
+    frame_period_us = 1000000 / frame_rate;
+    if (animation_timer) {
+        return true;
+    }
+
+    for (int i = 0; i < 256; i++) {
+        gamma_table[i] = roundf(powf(i / 255.0f, LED_GAMMA) * 255);
+    }
+
+    const esp_timer_create_args_t args = {
+        .callback = animation_timer_callback,
+        .arg = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "led_animation",
+        .skip_unhandled_events = true,
+    };
+    return esp_timer_create(&args, &animation_timer) == ESP_OK;
+}
+
+int start_animation(const animation &settings) {
+    int num_leds = frame_bytes / 3;
+    animation checked = settings;
+    if (checked.num_leds == 0) {
+        checked.num_leds = num_leds - checked.first_led;
+    }
+    if (!animation_timer || checked.num_keyframes < 0 || checked.num_keyframes > MAX_KEYFRAMES ||
+        checked.period_ms == 0 || checked.first_led < 0 || checked.num_leds <= 0 ||
+        checked.first_led + checked.num_leds > num_leds) {
+        return -1;
+    }
+
+    int id = -1;
+    portENTER_CRITICAL(&animation_lock);
+    for (int i = 0; i < MAX_ANIMATIONS; i++) {
+        if (!animations[i].active) {
+            animations[i].settings = checked;
+            animations[i].active = true;
+            animations[i].start_ms = now_ms();
+            id = i;
+            break;
+        }
+    }
+    if (id >= 0 && !timer_running) {
+        timer_running = esp_timer_start_periodic(animation_timer, frame_period_us) == ESP_OK;
+    }
+    portEXIT_CRITICAL(&animation_lock);
+
+    return id;
+}
+
+void stop_animation(int id) {
+    if (id < 0 || id >= MAX_ANIMATIONS) {
+        return;
+    }
+
+    // After the last one, the next tick puts back the LEDs the animations were covering
+    portENTER_CRITICAL(&animation_lock);
+    animations[id].active = false;
+    portEXIT_CRITICAL(&animation_lock);
+}
+
+void stop_all_animations() {
+    for (int i = 0; i < MAX_ANIMATIONS; i++) {
+        stop_animation(i);
+    }
+}
+
+bool is_animating() { return timer_running; }
+
+void set_animation_brightness(uint8_t brightness) { brightness_scale = brightness + 1; }
+
+////////////////////////////// Private Functions ///////////////////////////////
+
+// Hands the frame to the output task, which sends it once the one being sent is done
+void queue_frame(const uint8_t *pixels) {
+    stage_frame(pixels);
+    xTaskNotifyGive(led_output_task_handle);
+}
+
+// Makes the frame the next one to send, without waking the output task. This can be done inside
+// another critical section, but the output task has to be notified after leaving it.
+void stage_frame(const uint8_t *pixels) {
+    portENTER_CRITICAL(&frame_lock);
+    memcpy(frame_buffers[back_buffer], pixels, frame_bytes);
+    frame_pending = true;
+    portEXIT_CRITICAL(&frame_lock);
+}
+
+void led_output_task(void *params) {
+    rmt_config_t config = RMT_DEFAULT_CONFIG_TX((gpio_num_t)(intptr_t)params, LED_RMT_CHANNEL);
+    config.clk_div = LED_RMT_CLK_DIV;
+
+    driver_ready = rmt_config(&config) == ESP_OK &&
+                   rmt_driver_install(LED_RMT_CHANNEL, 0, 0) == ESP_OK &&
+                   rmt_translator_init(LED_RMT_CHANNEL, ws2812_translator) == ESP_OK;
+    xSemaphoreGive(driver_setup_done);
+
+    if (!driver_ready) {
+        vTaskDelete(NULL);
+    }
+
+    while (1) {
+        // Block waiting for a frame
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (1) {
+            // Swap buffers so the next frame can be written while this one is clocked out
+            portENTER_CRITICAL(&frame_lock);
+            if (!frame_pending) {
+                portEXIT_CRITICAL(&frame_lock);
+                break;
+            }
+            const uint8_t *front = frame_buffers[back_buffer];
+            back_buffer ^= 1;
+            frame_pending = false;
+            transmitting = true;
+            portEXIT_CRITICAL(&frame_lock);
+
+            rmt_write_sample(LED_RMT_CHANNEL, front, frame_bytes, true);
+
+            // The LEDs latch the frame once the line has been held low for a few hundred us
+            vTaskDelay(1);
+            transmitting = false;
+        }
+    }
+}
+
+// Runs in the esp_timer task. The animations are positioned by the time now rather than by
+// counting ticks, so a late tick doesn't put them behind. Only copies are made under the lock,
+// and the animations are drawn from the copies after leaving it.
+void animation_timer_callback(void *arg) {
+    static animation_slot_t active[MAX_ANIMATIONS];
+    int num_active = 0;
+    uint32_t now = now_ms();
+
+    portENTER_CRITICAL(&animation_lock);
+    memcpy(animation_frame, base_frame, frame_bytes);
+    for (int i = 0; i < MAX_ANIMATIONS; i++) {
+        if (animations[i].active) {
+            active[num_active++] = animations[i];
+        }
+    }
+
+    // With nothing left to draw, send the base frame while still holding the lock, so it can't
+    // end up after a newer frame from show_async
+    if (num_active == 0) {
+        esp_timer_stop(animation_timer);
+        timer_running = false;
+        stage_frame(animation_frame);
+    }
+    portEXIT_CRITICAL(&animation_lock);
+
+    for (int i = 0; i < num_active; i++) {
+        draw_animation(active[i], now);
+    }
+    if (num_active > 0) {
+        stage_frame(animation_frame);
+    }
+    xTaskNotifyGive(led_output_task_handle);
+}
+
+void draw_animation(const animation_slot_t &slot, uint32_t now_ms) {
+    const animation &settings = slot.settings;
+    uint32_t elapsed_ms = now_ms - slot.start_ms;
+
+    for (int i = 0; i < settings.num_leds; i++) {
+        uint8_t rgb[3];
+        switch (settings.effect) {
+        case EFFECT_KEYFRAMES:
+            keyframe_color(settings, elapsed_ms, rgb);
+            break;
+        case EFFECT_CHASE:
+            keyframe_color(settings, (int64_t)elapsed_ms - (int64_t)i * settings.led_offset_ms,
+                           rgb);
+            break;
+        case EFFECT_RAINBOW:
+            hue_color((uint64_t)(elapsed_ms % settings.period_ms) * HUE_STEPS /
+                              settings.period_ms +
+                          i * HUE_STEPS / settings.num_leds,
+                      rgb);
+            break;
+        }
+
+        uint8_t *pixel = animation_frame + (settings.first_led + i) * 3;
+        pixel[0] = (gamma_table[rgb[1]] * brightness_scale) >> 8;
+        pixel[1] = (gamma_table[rgb[0]] * brightness_scale) >> 8;
+        pixel[2] = (gamma_table[rgb[2]] * brightness_scale) >> 8;
+    }
+}
+
+// Finds the color time_ms into the animation, between the keyframes on either side
+void keyframe_color(const animation &settings, int64_t time_ms, uint8_t *rgb) {
+    const keyframe *keyframes = settings.keyframes;
+    int last = settings.num_keyframes - 1;
+    if (last < 0) {
+        rgb[0] = rgb[1] = rgb[2] = 0;
+        return;
+    }
+
+    int64_t period_ms = settings.period_ms;
+    if (settings.repeat) {
+        time_ms %= period_ms;
+        if (time_ms < 0) {
+            time_ms += period_ms;
+        }
+    }
+
+    // With repeat, the last keyframe fades into the first one a period later. Otherwise, the
+    // colors before the first keyframe and after the last one are held.
+    const keyframe *from;
+    const keyframe *to;
+    int64_t from_ms;
+    int64_t to_ms;
+    if (time_ms < keyframes[0].time_ms) {
+        from = settings.repeat ? &keyframes[last] : &keyframes[0];
+        to = &keyframes[0];
+        from_ms = from->time_ms - period_ms;
+        to_ms = to->time_ms;
+    } else {
+        int i = 0;
+        while (i < last && time_ms >= keyframes[i + 1].time_ms) {
+            i++;
+        }
+        from = &keyframes[i];
+        to = i < last ? &keyframes[i + 1] : (settings.repeat ? &keyframes[0] : from);
+        from_ms = from->time_ms;
+        to_ms = i < last ? to->time_ms : to->time_ms + period_ms;
+    }
+
+    // How far it is from one keyframe to the next, in 16.16 fixed point
+    uint32_t fraction = 0;
+    if (to_ms > from_ms) {
+        fraction = ((uint64_t)(time_ms - from_ms) << 16) / (uint64_t)(to_ms - from_ms);
+    }
+    rgb[0] = interpolate(from->red, to->red, fraction);
+    rgb[1] = interpolate(from->green, to->green, fraction);
+    rgb[2] = interpolate(from->blue, to->blue, fraction);
+}
+
+// The hue goes from red at 0 through yellow, green, cyan, blue and magenta back to red
+void hue_color(uint32_t hue, uint8_t *rgb) {
+    hue %= HUE_STEPS;
+    uint8_t rise = hue & 0xFF;
+    uint8_t fall = 255 - rise;
+
+    switch (hue >> 8) {
+    case 0:
+        rgb[0] = 255, rgb[1] = rise, rgb[2] = 0;
+        break;
+    case 1:
+        rgb[0] = fall, rgb[1] = 255, rgb[2] = 0;
+        break;
+    case 2:
+        rgb[0] = 0, rgb[1] = 255, rgb[2] = rise;
+        break;
+    case 3:
+        rgb[0] = 0, rgb[1] = fall, rgb[2] = 255;
+        break;
+    case 4:
+        rgb[0] = rise, rgb[1] = 0, rgb[2] = 255;
+        break;
+    default:
+        rgb[0] = 255, rgb[1] = 0, rgb[2] = fall;
+        break;
+    }
+}
+
+uint8_t interpolate(uint8_t from, uint8_t to, uint32_t fraction) {
+    return from + (((int32_t)(to - from) * (int32_t)fraction) >> 16);
+}
+
+uint32_t now_ms() { return esp_timer_get_time() / 1000; }
+
+// Converts the GRB bytes into RMT items while the frame is being sent
+void IRAM_ATTR ws2812_translator(const void *src, rmt_item32_t *dest, size_t src_size,
+                                 size_t wanted_num, size_t *translated_size, size_t *item_num) {
+    const rmt_item32_t bit0 = {{{T0H_TICKS, 1, T0L_TICKS, 0}}};
+    const rmt_item32_t bit1 = {{{T1H_TICKS, 1, T1L_TICKS, 0}}};
+
+    const uint8_t *psrc = (const uint8_t *)src;
+    size_t size = 0;
+    size_t num = 0;
+    while (size < src_size && num + 8 <= wanted_num) {
+        for (int bit = 7; bit >= 0; bit--) {
+            dest[num++].val = (psrc[size] & (1 << bit)) ? bit1.val : bit0.val;
+        }
+        size++;
+    }
+
+    *translated_size = size;
+    *item_num = num;
+}
+
+#else
+
+// The ESP-IDF 5 RMT driver cannot be mixed with the one used by Adafruit_NeoPixel, so LED
+// output stays blocking on this framework version
+bool setup_async_output(int pin, size_t num_bytes) { return false; }
+
+void show_async(const uint8_t *pixels) {}
+
+bool is_showing() { return false; }
+
+bool setup_animations(int frame_rate) { return false; }
+
+int start_animation(const animation &animation) { return -1; }
+
+void stop_animation(int id) {}
+
+void stop_all_animations() {}
+
+bool is_animating() { return false; }
+
+void set_animation_brightness(uint8_t brightness) {}
+
+#endif
+}; // namespace YLeds
@@ -0,0 +1,264 @@
+#include "ynotes.h"
+
+#include <algorithm>
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+
+namespace YNotes {
+
+///////////////////////////////// Configuration Constants //////////////////////
+
+// A 'z' is a short rest added to the end of songs, to stop speaker crackle
+static const float END_REST_SECONDS = 0.2;
+
+//////////////////////////// Private Function Prototypes ///////////////////////
+static bool parse_note(const char *&p, const note_state &state, float &note_freq,
+                       float &duration_s);
+static bool parse_number(const char *&p, int &value);
+static uint16_t to_frequency(float note_freq);
+
+////////////////////////////// Public Functions ///////////////////////////////
+
+compile_result compile(const char *notes, note_state &state, uint32_t sample_rate,
+                       note_queue &queue, const char **error_at) {
+    const char *p = notes;
+
+    while (*p) {
+        // Skip white space
+        if (isspace(*p)) {
+            p++;
+            continue;
+        }
+
+        // Octave
+        if (*p == 'O' || *p == 'o') {
+            int new_octave = p[1] - '0';
+            if (new_octave >= 4 && new_octave <= 7) {
+                state.octave = new_octave;
+            }
+            p += p[1] ? 2 : 1;
+            continue;
+        }
+
+        // Tempo
+        if (*p == 'T' || *p == 't') {
+            p++;
+            int new_tempo;
+            if (!parse_number(p, new_tempo)) {
+                break;
+            }
+            if (new_tempo >= 40 && new_tempo <= 240) {
+                state.beats_per_minute = new_tempo;
+            }
+            continue;
+        }
+
+        // Reset
+        if (*p == '!') {
+            state = note_state();
+            p++;
+            continue;
+        }
+
+        // Volume
+        if (*p == 'V' || *p == 'v') {
+            p++;
+            int new_volume;
+            if (!parse_number(p, new_volume)) {
+                break;
+            }
+            if (new_volume >= 1 && new_volume <= 10) {
+                state.volume = new_volume;
+            }
+            continue;
+        }
+
+        // Waveform
+        if (*p == 'W' || *p == 'w') {
+            p++;
+            int new_waveform;
+            if (!parse_number(p, new_waveform)) {
+                break;
+            }
+            if (new_waveform >= 1 && new_waveform <= NUM_WAVEFORMS) {
+                state.wave = (waveform)(new_waveform - 1);
+            }
+            continue;
+        }
+
+        note new_note = {};
+        new_note.volume = state.volume;
+        new_note.wave = state.wave;
+        float note_freq;
+        float duration_s;
+
+        if (*p == '(') {
+            // Chord, which lasts as long as its longest note
+            const char *chord_start = p;
+            p++;
+            int num_voices = 0;
+            float chord_duration_s = 0;
+            while (*p && *p != ')') {
+                if (isspace(*p)) {
+                    p++;
+                    continue;
+                }
+                if (num_voices == MAX_VOICES || !parse_note(p, state, note_freq, duration_s)) {
+                    break;
+                }
+                new_note.frequency[num_voices++] = to_frequency(note_freq);
+                chord_duration_s = std::max(chord_duration_s, duration_s);
+            }
+            if (*p != ')') {
+                // A chord that is never closed is reported where it starts
+                if (!*p) {
+                    p = chord_start;
+                }
+                break;
+            }
+            p++;
+            duration_s = chord_duration_s;
+        } else if (parse_note(p, state, note_freq, duration_s)) {
+            new_note.frequency[0] = to_frequency(note_freq);
+        } else {
+            // If we reach here then we have a syntax error
+            break;
+        }
+
+        if (queue.tail - queue.head == queue.queue_size) {
+            return COMPILE_QUEUE_FULL;
+        }
+        new_note.duration = lround(duration_s * sample_rate);
+        queue.notes[queue.tail % queue.queue_size] = new_note;
+        queue.tail++;
+    }
+
+    if (*p) {
+        if (error_at) {
+            *error_at = p;
+        }
+        return COMPILE_SYNTAX_ERROR;
+    }
+
+    return COMPILE_OK;
+}
+
+////////////////////////////// Private Functions ///////////////////////////////
+
+// Parses a single note and its modifiers. Returns false if p doesn't point to a note.
+bool parse_note(const char *&p, const note_state &state, float &note_freq, float &duration_s) {
+    duration_s = (60.0 / state.beats_per_minute); // Quarter note duration in seconds
+
+    // A-G regular notes
+    // R for rest
+    // z for end rest, which is added internally to stop speaker crackle at the end
+    switch (*p) {
+    case 'A':
+    case 'a':
+        note_freq = 440.0;
+        break;
+    case 'B':
+    case 'b':
+        note_freq = 493.88;
+        break;
+    case 'C':
+    case 'c':
+        note_freq = 523.25;
+        break;
+    case 'D':
+    case 'd':
+        note_freq = 587.33;
+        break;
+    case 'E':
+    case 'e':
+        note_freq = 659.25;
+        break;
+    case 'F':
+    case 'f':
+        note_freq = 698.46;
+        break;
+    case 'G':
+    case 'g':
+        note_freq = 783.99;
+        break;
+    case 'z':
+        duration_s = END_REST_SECONDS;
+        // Fallthrough
+    case 'R':
+    case 'r':
+        note_freq = 0;
+        break;
+    default:
+        return false;
+    }
+
+    // Adjust frequency for octave
+    note_freq *= pow(2, state.octave - 4);
+    p++;
+
+    float dot_duration = duration_s;
+
+    // Note modifiers
+    while (1) {
+
+        // Duration
+        if (isdigit(*p)) {
+            int frac_duration;
+            parse_number(p, frac_duration);
+            if (frac_duration >= 1 && frac_duration <= 2000) {
+                duration_s = duration_s * (4.0 / frac_duration);
+            }
+            continue;
+        }
+
+        // Dot
+        if (*p == '.') {
+            dot_duration /= 2;
+            duration_s += dot_duration;
+            p++;
+            continue;
+        }
+
+        // Octave
+        if (*p == '>') {
+            note_freq *= 2;
+            p++;
+            continue;
+        }
+        if (*p == '<') {
+            note_freq /= 2;
+            p++;
+            continue;
+        }
+
+        // Sharp/flat
+        if (*p == '#' || *p == '+' || *p == '-') {
+            if (*p == '#' || *p == '+') {
+                note_freq *= pow(2, 1.0 / 12);
+            } else {
+                note_freq /= pow(2, 1.0 / 12);
+            }
+            p++;
+            continue;
+        }
+
+        break;
+    }
+
+    return true;
+}
+
+bool parse_number(const char *&p, int &value) {
+    char *end;
+    value = strtol(p, &end, 10);
+    if (end == p) {
+        return false;
+    }
+
+    p = end;
+    return true;
+}
+
+uint16_t to_frequency(float note_freq) { return std::min(roundf(note_freq), 65535.0f); }
+}; // namespace YNotes
@@ -0,0 +1,191 @@
+// Unit tests for the note compiler, which run on the host. Run them with:
+//     pio test -e native
+
+#include "ynotes.h"
+
+#include <unity.h>
+
+static const uint32_t SAMPLE_RATE = 44100;
+static const uint32_t QUEUE_SIZE = 16;
+
+// At the default 120 beats per minute, a quarter note is half a second
+static const uint32_t QUARTER_NOTE = SAMPLE_RATE / 2;
+
+static YNotes::note notes[QUEUE_SIZE];
+static YNotes::note_state state;
+static YNotes::note_queue queue;
+
+void setUp() {
+    state = YNotes::note_state();
+    queue = {notes, QUEUE_SIZE, 0, 0};
+}
+
+void tearDown() {}
+
+static YNotes::compile_result compile(const char *song, const char **error_at = NULL) {
+    return YNotes::compile(song, state, SAMPLE_RATE, queue, error_at);
+}
+
+static void test_notes_use_the_current_octave() {
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_OK, compile("A C O4 A C O7 A"));
+    TEST_ASSERT_EQUAL_UINT32(5, queue.tail);
+    TEST_ASSERT_EQUAL_UINT16(880, notes[0].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT16(1047, notes[1].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT16(440, notes[2].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT16(523, notes[3].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT16(3520, notes[4].frequency[0]);
+    TEST_ASSERT_EQUAL(7, state.octave);
+}
+
+static void test_out_of_range_octave_is_ignored() {
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_OK, compile("O3 A O8 A"));
+    TEST_ASSERT_EQUAL_UINT16(880, notes[0].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT16(880, notes[1].frequency[0]);
+    TEST_ASSERT_EQUAL(5, state.octave);
+}
+
+static void test_note_modifiers() {
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_OK, compile("O4 A# A+ A- A> A< A#>"));
+    TEST_ASSERT_EQUAL_UINT16(466, notes[0].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT16(466, notes[1].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT16(415, notes[2].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT16(880, notes[3].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT16(220, notes[4].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT16(932, notes[5].frequency[0]);
+
+    // Modifiers only apply to their own note
+    TEST_ASSERT_EQUAL(4, state.octave);
+}
+
+static void test_rests_are_silent() {
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_OK, compile("R r8"));
+    TEST_ASSERT_EQUAL_UINT32(2, queue.tail);
+    for (int i = 0; i < YNotes::MAX_VOICES; i++) {
+        TEST_ASSERT_EQUAL_UINT16(0, notes[0].frequency[i]);
+        TEST_ASSERT_EQUAL_UINT16(0, notes[1].frequency[i]);
+    }
+    TEST_ASSERT_EQUAL_UINT32(QUARTER_NOTE, notes[0].duration);
+    TEST_ASSERT_EQUAL_UINT32(QUARTER_NOTE / 2, notes[1].duration);
+}
+
+static void test_durations_are_exact_sample_counts() {
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_OK, compile("C C1 C2 C8 C16 C4. C4.. C2000"));
+    TEST_ASSERT_EQUAL_UINT32(22050, notes[0].duration);
+    TEST_ASSERT_EQUAL_UINT32(88200, notes[1].duration);
+    TEST_ASSERT_EQUAL_UINT32(44100, notes[2].duration);
+    TEST_ASSERT_EQUAL_UINT32(11025, notes[3].duration);
+    TEST_ASSERT_EQUAL_UINT32(5513, notes[4].duration);
+    TEST_ASSERT_EQUAL_UINT32(33075, notes[5].duration);
+    TEST_ASSERT_EQUAL_UINT32(38588, notes[6].duration);
+    TEST_ASSERT_EQUAL_UINT32(44, notes[7].duration);
+}
+
+static void test_tempo_sets_the_note_length() {
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_OK, compile("T60 C T240 C T30 C T241 C"));
+    TEST_ASSERT_EQUAL_UINT32(44100, notes[0].duration);
+    TEST_ASSERT_EQUAL_UINT32(11025, notes[1].duration);
+
+    // Tempos out of range are ignored
+    TEST_ASSERT_EQUAL_UINT32(11025, notes[2].duration);
+    TEST_ASSERT_EQUAL_UINT32(11025, notes[3].duration);
+    TEST_ASSERT_EQUAL(240, state.beats_per_minute);
+}
+
+static void test_volume_and_waveform() {
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_OK, compile("C V10 W2 C V0 W5 C W4 V1 C"));
+    TEST_ASSERT_EQUAL_UINT8(5, notes[0].volume);
+    TEST_ASSERT_EQUAL(YNotes::WAVE_SINE, notes[0].wave);
+    TEST_ASSERT_EQUAL_UINT8(10, notes[1].volume);
+    TEST_ASSERT_EQUAL(YNotes::WAVE_SQUARE, notes[1].wave);
+    TEST_ASSERT_EQUAL_UINT8(10, notes[2].volume);
+    TEST_ASSERT_EQUAL(YNotes::WAVE_SQUARE, notes[2].wave);
+    TEST_ASSERT_EQUAL_UINT8(1, notes[3].volume);
+    TEST_ASSERT_EQUAL(YNotes::WAVE_SAWTOOTH, notes[3].wave);
+}
+
+static void test_chord_lasts_as_long_as_its_longest_note() {
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_OK, compile("O4 (C8 E G2) A"));
+    TEST_ASSERT_EQUAL_UINT32(2, queue.tail);
+    TEST_ASSERT_EQUAL_UINT16(523, notes[0].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT16(659, notes[0].frequency[1]);
+    TEST_ASSERT_EQUAL_UINT16(784, notes[0].frequency[2]);
+    TEST_ASSERT_EQUAL_UINT16(0, notes[0].frequency[3]);
+    TEST_ASSERT_EQUAL_UINT32(QUARTER_NOTE * 2, notes[0].duration);
+    TEST_ASSERT_EQUAL_UINT16(440, notes[1].frequency[0]);
+}
+
+static void test_chord_with_too_many_voices_is_a_syntax_error() {
+    const char *song = "C (C D E F G)";
+    const char *error_at = NULL;
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_SYNTAX_ERROR, compile(song, &error_at));
+    TEST_ASSERT_EQUAL_PTR(song + 11, error_at);
+    TEST_ASSERT_EQUAL_UINT32(1, queue.tail);
+}
+
+static void test_syntax_error_points_at_the_error() {
+    const char *song = "C D X E";
+    const char *error_at = NULL;
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_SYNTAX_ERROR, compile(song, &error_at));
+    TEST_ASSERT_EQUAL_PTR(song + 4, error_at);
+
+    // The notes before the error are kept
+    TEST_ASSERT_EQUAL_UINT32(2, queue.tail);
+}
+
+static void test_unclosed_chord_is_a_syntax_error() {
+    const char *song = "C (E G";
+    const char *error_at = NULL;
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_SYNTAX_ERROR, compile(song, &error_at));
+    TEST_ASSERT_EQUAL_PTR(song + 2, error_at);
+    TEST_ASSERT_EQUAL_UINT32(1, queue.tail);
+}
+
+static void test_full_queue() {
+    queue.queue_size = 4;
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_OK, compile("C D E"));
+    queue.head = 1;
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_QUEUE_FULL, compile("F G A"));
+    TEST_ASSERT_EQUAL_UINT32(5, queue.tail);
+
+    // The ring buffer wrapped around to the start
+    TEST_ASSERT_EQUAL_UINT16(1568, notes[0].frequency[0]);
+}
+
+static void test_reset_restores_defaults() {
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_OK, compile("T60 O7 V9 W3 C ! C"));
+    TEST_ASSERT_EQUAL_UINT32(44100, notes[0].duration);
+    TEST_ASSERT_EQUAL_UINT16(4186, notes[0].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT32(QUARTER_NOTE, notes[1].duration);
+    TEST_ASSERT_EQUAL_UINT16(1047, notes[1].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT8(5, notes[1].volume);
+    TEST_ASSERT_EQUAL(YNotes::WAVE_SINE, notes[1].wave);
+    TEST_ASSERT_EQUAL(120, state.beats_per_minute);
+    TEST_ASSERT_EQUAL(5, state.octave);
+}
+
+static void test_state_carries_over() {
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_OK, compile("T60 O4"));
+    TEST_ASSERT_EQUAL_UINT32(0, queue.tail);
+    TEST_ASSERT_EQUAL(YNotes::COMPILE_OK, compile("A"));
+    TEST_ASSERT_EQUAL_UINT16(440, notes[0].frequency[0]);
+    TEST_ASSERT_EQUAL_UINT32(44100, notes[0].duration);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_notes_use_the_current_octave);
+    RUN_TEST(test_out_of_range_octave_is_ignored);
+    RUN_TEST(test_note_modifiers);
+    RUN_TEST(test_rests_are_silent);
+    RUN_TEST(test_durations_are_exact_sample_counts);
+    RUN_TEST(test_tempo_sets_the_note_length);
+    RUN_TEST(test_volume_and_waveform);
+    RUN_TEST(test_chord_lasts_as_long_as_its_longest_note);
+    RUN_TEST(test_chord_with_too_many_voices_is_a_syntax_error);
+    RUN_TEST(test_syntax_error_points_at_the_error);
+    RUN_TEST(test_unclosed_chord_is_a_syntax_error);
+    RUN_TEST(test_full_queue);
+    RUN_TEST(test_reset_restores_defaults);
+    RUN_TEST(test_state_carries_over);
+    return UNITY_END();
+}